@@ -0,0 +1,74 @@
+"""
+Per-call cost of looking up the current cpu.
+
+Compares current_cpu() and current_node(), which read the rseq area of
+the calling thread, with sched_getcpu(3) and the raw getcpu(2) syscall
+called through ctypes, the closest Python 2 has to os.sched_getcpu. An
+empty loop and gettid(), a cheap syscall behind the same METH_NOARGS
+calling convention, are measured for reference.
+"""
+import ctypes
+import json
+import sys
+import time
+
+import prctl
+
+LOOPS = 1000000
+SYS_getcpu = 309
+
+libc = ctypes.CDLL(None, use_errno=True)
+libc.sched_getcpu.restype = ctypes.c_int
+libc.syscall.restype = ctypes.c_long
+
+
+def getcpu_syscall(cpu=ctypes.c_uint(), node=ctypes.c_uint()):
+    libc.syscall(SYS_getcpu, ctypes.byref(cpu), ctypes.byref(node), None)
+    return cpu.value
+
+
+def measure(func, loops):
+    best = None
+
+    for attempt in range(5):
+        start = time.time()
+        if func is None:
+            for i in xrange(loops):
+                pass
+        else:
+            for i in xrange(loops):
+                func()
+        elapsed = time.time() - start
+        if best is None or elapsed < best:
+            best = elapsed
+
+    return best
+
+
+def main():
+    loops = int(sys.argv[1]) if len(sys.argv) > 1 else LOOPS
+
+    candidates = [
+        ("current_cpu", prctl.current_cpu),
+        ("current_node", prctl.current_node),
+        ("gettid", prctl.gettid),
+        ("ctypes_sched_getcpu", libc.sched_getcpu),
+        ("ctypes_getcpu_syscall", getcpu_syscall),
+    ]
+
+    results = {
+        "rseq": prctl.rseq_status(),
+        "loops": loops,
+        "loop_ns": measure(None, loops) / loops * 1e9,
+        "calls": {},
+    }
+
+    for name, func in candidates:
+        elapsed = measure(func, loops)
+        results["calls"][name] = elapsed / loops * 1e9
+
+    print json.dumps(results, indent=2, sort_keys=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,248 @@
+"""
+Measured effect of the settings the module controls.
+
+  timerslack  wakeup overshoot of short sleeps for several slack values
+  sleep       overshoot of time.sleep() against precise_sleep()
+  thp         fault-in and random access time of a buffer with and
+              without transparent huge pages
+  spawn       processes per second from the zygote, with and without
+              attributes applied, against plain fork()
+  seccomp     cost of a trivial syscall under stacked seccomp filters,
+              both ones the kernel can cache and ones it has to run
+
+Sections can be selected by naming them on the command line.
+"""
+import ctypes
+import json
+import os
+import random
+import signal
+import socket
+import sys
+import time
+
+import prctl
+
+PR_SET_NO_NEW_PRIVS = 38
+PR_SET_SECCOMP = 22
+SECCOMP_MODE_FILTER = 2
+SECCOMP_RET_ALLOW = 0x7fff0000
+BPF_LD_W_ABS = 0x20
+BPF_RET_K = 0x06
+SECCOMP_DATA_ARG0 = 16
+
+libc = ctypes.CDLL(None, use_errno=True)
+
+
+def percentile(values, fraction):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * fraction))]
+
+
+def timerslack():
+    original = prctl.prctl(prctl.TIMERSLACK)
+    request = 0.0005
+    results = {}
+
+    try:
+        for slack in (1, 50000, 1000000):
+            prctl.prctl(prctl.TIMERSLACK, slack)
+            overshoot = []
+            for i in xrange(500):
+                start = time.time()
+                time.sleep(request)
+                overshoot.append((time.time() - start - request) * 1e6)
+
+            results[str(slack)] = {
+                "mean_us": sum(overshoot) / len(overshoot),
+                "p50_us": percentile(overshoot, 0.5),
+                "p99_us": percentile(overshoot, 0.99),
+            }
+    finally:
+        prctl.prctl(prctl.TIMERSLACK, original)
+
+    return results
+
+
+def sleep(request=200000):
+    overshoot = {"time.sleep": [], "precise_sleep": []}
+
+    for i in xrange(500):
+        start = time.time()
+        time.sleep(request / 1e9)
+        overshoot["time.sleep"].append(
+            (time.time() - start) * 1e9 - request)
+        overshoot["precise_sleep"].append(prctl.precise_sleep(request))
+
+    results = {}
+    for name, values in overshoot.items():
+        results[name] = {
+            "p50_us": percentile(values, 0.5) / 1e3,
+            "p99_us": percentile(values, 0.99) / 1e3,
+        }
+    results["wakeup_p99_us"] = prctl.wakeup_latency(500, 0.0002).p99 / 1e3
+
+    return results
+
+
+def thp(size=128 << 20, reads=1000000):
+    page = os.sysconf("SC_PAGESIZE")
+    offsets = [random.randrange(size) for i in xrange(reads)]
+    results = {}
+
+    for mode in (None, "thp"):
+        before = prctl.smaps_rollup().anon_huge_pages
+        buf = prctl.alloc_buffer(size, hugepages=mode)
+
+        start = time.time()
+        for offset in xrange(0, size, page):
+            buf[offset] = "x"
+        fault = time.time() - start
+
+        start = time.time()
+        for offset in offsets:
+            buf[offset]
+        access = time.time() - start
+
+        results[mode or "none"] = {
+            "fault_ms": fault * 1e3,
+            "random_read_ns": access / reads * 1e9,
+            "anon_huge_bytes": prctl.smaps_rollup().anon_huge_pages - before,
+        }
+        del buf
+
+    return results
+
+
+def zygote():
+    parent, child = socket.socketpair(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    pid = os.fork()
+    if pid == 0:
+        parent.close()
+        prctl.zygote_serve(child.fileno())
+        os._exit(0)
+
+    child.close()
+    return parent, pid
+
+
+def spawn(count=500):
+    attributes = {
+        "pdeathsig": signal.SIGTERM,
+        "name": "bench-worker",
+        "timerslack": 1,
+        "dumpable": 0,
+        "nice": 1,
+    }
+    results = {}
+
+    start = time.time()
+    for i in xrange(count):
+        pid = os.fork()
+        if pid == 0:
+            os._exit(0)
+        os.waitpid(pid, 0)
+    results["fork"] = count / (time.time() - start)
+
+    sock, server = zygote()
+    try:
+        for label, kw in (("zygote", {}), ("zygote_attributes", attributes)):
+            start = time.time()
+            for i in xrange(count):
+                pid, pidfd = prctl.zygote_spawn(sock.fileno(), **kw)
+                if pidfd is not None:
+                    os.close(pidfd)
+            results[label] = count / (time.time() - start)
+    finally:
+        sock.close()
+        os.waitpid(server, 0)
+
+    return dict((key, {"spawns_per_sec": value})
+                for key, value in results.items())
+
+
+class SockFilter(ctypes.Structure):
+    _fields_ = [("code", ctypes.c_ushort), ("jt", ctypes.c_ubyte),
+                ("jf", ctypes.c_ubyte), ("k", ctypes.c_uint)]
+
+
+class SockFprog(ctypes.Structure):
+    _fields_ = [("len", ctypes.c_ushort),
+                ("filter", ctypes.POINTER(SockFilter))]
+
+
+def install_filter(inspect_args):
+    program = []
+    if inspect_args:
+        # reading an argument defeats the kernel's per-syscall verdict cache
+        program.append(SockFilter(BPF_LD_W_ABS, 0, 0, SECCOMP_DATA_ARG0))
+    program.append(SockFilter(BPF_RET_K, 0, 0, SECCOMP_RET_ALLOW))
+
+    instructions = (SockFilter * len(program))(*program)
+    fprog = SockFprog(len(program), instructions)
+
+    if libc.prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER,
+                  ctypes.byref(fprog), 0, 0) < 0:
+        raise OSError(ctypes.get_errno(), "PR_SET_SECCOMP")
+
+
+def syscall_cost(filters, inspect_args, loops=200000):
+    read, write = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        os.close(read)
+        try:
+            libc.prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)
+            for i in xrange(filters):
+                install_filter(inspect_args)
+
+            start = time.time()
+            for i in xrange(loops):
+                os.getppid()
+            result = (time.time() - start) / loops * 1e9
+        except OSError, exc:
+            result = -exc.errno
+        os.write(write, json.dumps(result))
+        os._exit(0)
+
+    os.close(write)
+    result = json.loads(os.read(read, 4096))
+    os.close(read)
+    os.waitpid(pid, 0)
+
+    return result
+
+
+def seccomp():
+    results = {"none": {"getppid_ns": syscall_cost(0, False)}}
+
+    for filters in (1, 4, 16):
+        for inspect_args in (False, True):
+            key = "%d_%s" % (filters, "args" if inspect_args else "cached")
+            results[key] = {"getppid_ns": syscall_cost(filters, inspect_args)}
+
+    return results
+
+
+SECTIONS = (
+    ("timerslack", timerslack),
+    ("sleep", sleep),
+    ("thp", thp),
+    ("spawn", spawn),
+    ("seccomp", seccomp),
+)
+
+
+def main():
+    selected = sys.argv[1:]
+    results = {}
+
+    for name, func in SECTIONS:
+        if not selected or name in selected:
+            results[name] = func()
+
+    print json.dumps(results, indent=2, sort_keys=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,84 @@
+"""
+Object heavy workload with and without hugepage_heap().
+
+Builds a large dict of small objects, then times random lookups over
+it. Each variant runs in a fresh interpreter; when perf(1) is available
+the dTLB load misses of the measured phase are reported as well.
+"""
+import json
+import os
+import random
+import subprocess
+import sys
+import time
+
+import prctl
+
+OBJECTS = 2000000
+LOOKUPS = 2000000
+
+
+def anon_huge_kb():
+    for line in open("/proc/self/smaps_rollup"):
+        if line.startswith("AnonHugePages:"):
+            return int(line.split()[1])
+    return 0
+
+
+def workload(advise):
+    heap = dict((i, (i, str(i))) for i in xrange(OBJECTS))
+    if advise:
+        prctl.hugepage_heap()
+
+    keys = [random.randrange(OBJECTS) for _ in xrange(LOOKUPS)]
+
+    start = time.time()
+    total = 0
+    for key in keys:
+        total += heap[key][0]
+    elapsed = time.time() - start
+
+    return {
+        "advise": advise,
+        "lookups_per_sec": LOOKUPS / elapsed,
+        "anon_huge_kb": anon_huge_kb(),
+    }
+
+
+def run(advise):
+    cmd = [sys.executable, __file__, "--child", str(int(advise))]
+    perf = None
+
+    for directory in os.environ.get("PATH", "").split(os.pathsep):
+        if os.access(os.path.join(directory, "perf"), os.X_OK):
+            perf = ["perf", "stat", "-x,", "-e", "dTLB-load-misses", "--"]
+            break
+
+    proc = subprocess.Popen((perf or []) + cmd, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE)
+    out, err = proc.communicate()
+    result = json.loads(out)
+
+    if perf:
+        for line in err.splitlines():
+            fields = line.split(",")
+            if len(fields) > 2 and fields[2].startswith("dTLB-load-misses"):
+                try:
+                    result["dtlb_load_misses"] = int(fields[0])
+                except ValueError:
+                    pass
+
+    return result
+
+
+def main():
+    if len(sys.argv) > 2 and sys.argv[1] == "--child":
+        print json.dumps(workload(bool(int(sys.argv[2]))))
+        return
+
+    results = [run(False), run(True)]
+    print json.dumps(results, indent=2)
+
+
+if __name__ == "__main__":
+    main()
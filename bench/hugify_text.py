@@ -0,0 +1,79 @@
+"""
+Startup and steady-state cost of hugify_text().
+
+Runs pystone in a fresh interpreter with and without the text of
+libpython (and any shared objects named on the command line) moved onto
+huge pages. Startup is the time hugify_text() itself takes; when perf(1)
+is available the iTLB load misses of each run are reported as well.
+"""
+import json
+import os
+import subprocess
+import sys
+import time
+
+from test import pystone
+
+import prctl
+
+LOOPS = 200000
+
+
+def workload(hugify, modules):
+    startup = 0.0
+    remapped = 0
+
+    if hugify:
+        start = time.time()
+        report = prctl.hugify_text(modules=modules)
+        startup = time.time() - start
+        remapped = sum(entry[3] for entry in report)
+
+    elapsed, stones = pystone.pystones(LOOPS)
+
+    return {
+        "hugify": hugify,
+        "startup_sec": startup,
+        "remapped_bytes": remapped,
+        "pystones": stones,
+    }
+
+
+def run(hugify, modules):
+    cmd = [sys.executable, __file__, "--child", str(int(hugify))] + modules
+    perf = None
+
+    for directory in os.environ.get("PATH", "").split(os.pathsep):
+        if os.access(os.path.join(directory, "perf"), os.X_OK):
+            perf = ["perf", "stat", "-x,", "-e", "iTLB-load-misses", "--"]
+            break
+
+    proc = subprocess.Popen((perf or []) + cmd, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE)
+    out, err = proc.communicate()
+    result = json.loads(out)
+
+    if perf:
+        for line in err.splitlines():
+            fields = line.split(",")
+            if len(fields) > 2 and fields[2].startswith("iTLB-load-misses"):
+                try:
+                    result["itlb_load_misses"] = int(fields[0])
+                except ValueError:
+                    pass
+
+    return result
+
+
+def main():
+    if len(sys.argv) > 2 and sys.argv[1] == "--child":
+        print json.dumps(workload(bool(int(sys.argv[2])), sys.argv[3:]))
+        return
+
+    modules = sys.argv[1:]
+    results = [run(False, modules), run(True, modules)]
+    print json.dumps(results, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,169 @@
+"""
+Writeback throughput of a storage daemon with and without IO_FLUSHER.
+
+A child process stands in for a FUSE or local storage daemon: it writes
+its backing file in 1MB blocks and fdatasync()s every 8MB, as it would
+when the kernel hands it dirty pages to write back. Meanwhile a second
+child holds anonymous memory and keeps dirtying page cache, so the
+daemon runs into dirty throttling and reclaim. The daemon's throughput
+and worst write stall are reported with the flag off and on.
+
+With --dir both write to the same directory. With --loop, which needs
+root, a freshly made ext4 filesystem is mounted from an image file: the
+hog dirties the mounted filesystem while the daemon writes next to the
+image on the backing filesystem, the shape in which a FUSE or loop
+daemon's writes are what cleans the filesystem above it. Setting
+IO_FLUSHER needs CAP_SYS_RESOURCE; without it the "on" run reports the
+errno. Not part of suite.py since it disturbs the whole host.
+
+usage: io_flusher.py [--dir DIR | --loop MB] [--seconds N]
+                     [--pressure MB] [--dirty MB]
+"""
+import errno
+import json
+import optparse
+import os
+import shutil
+import subprocess
+import tempfile
+import time
+
+import prctl
+
+BLOCK = 1 << 20
+SYNC_EVERY = 8
+
+
+def loop_mount(size):
+    backing = tempfile.mkdtemp(prefix="io_flusher-", dir="/var/tmp")
+    fd, image = tempfile.mkstemp(prefix="image-", dir=backing)
+    mount = tempfile.mkdtemp(prefix="io_flusher-")
+
+    os.ftruncate(fd, size << 20)
+    os.close(fd)
+    device = subprocess.check_output(
+        ["losetup", "--find", "--show", image]).strip()
+    subprocess.check_call(["mkfs.ext4", "-q", device])
+    subprocess.check_call(["mount", device, mount])
+
+    def cleanup():
+        subprocess.call(["umount", mount])
+        subprocess.call(["losetup", "-d", device])
+        shutil.rmtree(backing)
+        os.rmdir(mount)
+
+    return mount, backing, cleanup
+
+
+def hog(directory, pressure, dirty):
+    held = bytearray(pressure << 20)
+    for offset in xrange(0, len(held), 4096):
+        held[offset] = 1
+
+    block = os.urandom(BLOCK)
+    path = os.path.join(directory, "hog")
+    while True:
+        fd = os.open(path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0600)
+        for i in xrange(dirty):
+            os.write(fd, block)
+        os.close(fd)
+
+
+def daemon(directory, seconds, flusher, report):
+    if flusher:
+        prctl.prctl(prctl.IO_FLUSHER, 1)
+
+    block = os.urandom(BLOCK)
+    fd = os.open(os.path.join(directory, "store"),
+                 os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0600)
+    written = 0
+    stall = 0.0
+
+    start = time.time()
+    while time.time() - start < seconds:
+        before = time.time()
+        os.write(fd, block)
+        written += 1
+        if written % SYNC_EVERY == 0:
+            os.fdatasync(fd)
+            os.lseek(fd, 0, os.SEEK_SET)
+        stall = max(stall, time.time() - before)
+    elapsed = time.time() - start
+    os.close(fd)
+
+    os.write(report, json.dumps({
+        "mb_per_sec": written / elapsed,
+        "max_stall_ms": stall * 1e3,
+    }))
+
+
+def measure(directory, backing, flusher, options):
+    hog_pid = os.fork()
+    if hog_pid == 0:
+        try:
+            hog(directory, options.pressure, options.dirty)
+        finally:
+            os._exit(0)
+
+    read, write = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        os.close(read)
+        try:
+            daemon(backing, options.seconds, flusher, write)
+        except prctl.PrctlError, exc:
+            code = exc.args[0]
+            os.write(write, json.dumps(
+                {"errno": errno.errorcode.get(code, code)}))
+        finally:
+            os._exit(0)
+
+    os.close(write)
+    out = ""
+    while True:
+        data = os.read(read, 4096)
+        if not data:
+            break
+        out += data
+    os.close(read)
+    os.waitpid(pid, 0)
+
+    os.kill(hog_pid, 9)
+    os.waitpid(hog_pid, 0)
+
+    return json.loads(out)
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option("--dir")
+    parser.add_option("--loop", type="int")
+    parser.add_option("--seconds", type="float", default=10)
+    parser.add_option("--pressure", type="int", default=512)
+    parser.add_option("--dirty", type="int", default=1024)
+    options, args = parser.parse_args()
+
+    cleanup = None
+    if options.loop:
+        directory, backing, cleanup = loop_mount(options.loop)
+    elif options.dir:
+        directory = backing = options.dir
+    else:
+        directory = tempfile.mkdtemp(prefix="io_flusher-", dir=".")
+        backing = directory
+        cleanup = lambda: shutil.rmtree(directory)
+
+    try:
+        results = {
+            "off": measure(directory, backing, False, options),
+            "on": measure(directory, backing, True, options),
+        }
+    finally:
+        if cleanup:
+            cleanup()
+
+    print json.dumps(results, indent=2, sort_keys=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,129 @@
+"""
+Per-call latency of the module's entry points.
+
+Every option of prctl() is timed on its get path and, by writing back
+the value just read, on its set path. Options the kernel or architecture
+rejects are reported with their errno instead of a time. The other entry
+points are timed with arguments which leave the process unchanged.
+"""
+import errno
+import json
+import sys
+import time
+
+import prctl
+
+LOOPS = 100000
+
+OPTIONS = (
+    "PDEATHSIG", "DUMPABLE", "UNALIGN", "KEEPCAPS", "FPEMU", "FPEXC",
+    "TIMING", "NAME", "ENDIAN", "TIMERSLACK", "CHILD_SUBREAPER",
+    "THP_DISABLE", "IO_FLUSHER",
+)
+
+
+def measure(func, loops):
+    best = None
+
+    for attempt in range(3):
+        start = time.time()
+        for i in xrange(loops):
+            func()
+        elapsed = time.time() - start
+        if best is None or elapsed < best:
+            best = elapsed
+
+    return best / loops * 1e9
+
+
+def attempt(func, loops):
+    try:
+        func()
+    except (prctl.PrctlError, OSError), exc:
+        code = exc.args[0]
+        return {"errno": errno.errorcode.get(code, code)}
+
+    return measure(func, loops)
+
+
+def options(loops):
+    results = {}
+
+    for name in OPTIONS:
+        option = getattr(prctl, name, None)
+        if option is None:
+            continue
+
+        get = lambda: prctl.prctl(option)
+        results[name + ".get"] = attempt(get, loops)
+
+        try:
+            value = get()
+        except prctl.PrctlError:
+            continue
+
+        results[name + ".set"] = attempt(lambda: prctl.prctl(option, value),
+                                         loops)
+
+    return results
+
+
+def entry_points(loops):
+    meter = prctl.Meter()
+    buf = prctl.alloc_buffer(1 << 21)
+
+    def measured():
+        with meter.measure("bench"):
+            pass
+
+    calls = [
+        ("gettid", prctl.gettid),
+        ("current_cpu", prctl.current_cpu),
+        ("current_node", prctl.current_node),
+        ("thread_times", prctl.thread_times),
+        ("usage_snapshot", prctl.usage_snapshot),
+        ("page_faults", prctl.page_faults),
+        ("meter.measure", measured),
+        ("sched_getattr", prctl.sched_getattr),
+        ("get_affinity", prctl.get_affinity),
+        ("get_mempolicy", prctl.get_mempolicy),
+        ("get_coredump_filter", prctl.get_coredump_filter),
+        ("locked_memory", prctl.locked_memory),
+        ("madvise", lambda: prctl.madvise(buf, prctl.MADV_NORMAL)),
+        ("proc_stat", prctl.proc_stat),
+        ("proc_status", prctl.proc_status),
+        ("smaps_rollup", prctl.smaps_rollup),
+        ("threads", prctl.threads),
+        ("malloc_trim", lambda: prctl.malloc_trim(1 << 30)),
+    ]
+
+    results = {}
+    for name, func in calls:
+        results[name] = attempt(func, loops)
+
+    return results
+
+
+def check_threads():
+    # a misparsed stat line shows up as a processor outside the mask
+    for thread in prctl.threads():
+        allowed = prctl.get_affinity(thread.tid)
+        if thread.processor not in allowed:
+            sys.exit("threads(): tid %d on cpu %d, affinity %r" %
+                     (thread.tid, thread.processor, allowed))
+
+
+def main():
+    loops = int(sys.argv[1]) if len(sys.argv) > 1 else LOOPS
+    check_threads()
+    results = {
+        "loops": loops,
+        "options_ns": options(loops),
+        "calls_ns": entry_points(loops / 10),
+    }
+
+    print json.dumps(results, indent=2, sort_keys=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,111 @@
+"""
+Run every benchmark and compare the results with a stored baseline.
+
+Each script in SCRIPTS runs in its own interpreter and prints JSON; the
+combined results are keyed by script name. Given a baseline written by
+an earlier run, every numeric result is listed with its relative change
+and those moving by more than the threshold are flagged. No baseline is
+shipped, as results only compare on the same host: record one with
+--output and pass it as --baseline later. A baseline which cannot be
+read is an error, raised before any benchmark runs.
+
+usage: suite.py [--output FILE] [--baseline FILE] [--threshold PERCENT]
+                [script ...]
+"""
+import json
+import optparse
+import os
+import subprocess
+import sys
+
+SCRIPTS = (
+    "latency",
+    "effects",
+    "current_cpu",
+    "heap_hugepages",
+    "hugify_text",
+)
+
+
+def run(name):
+    script = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          name + ".py")
+    proc = subprocess.Popen([sys.executable, script], stdout=subprocess.PIPE)
+    out, err = proc.communicate()
+
+    if proc.returncode:
+        return {"error": "exit status %d" % proc.returncode}
+
+    return json.loads(out)
+
+
+def flatten(value, prefix=""):
+    if isinstance(value, dict):
+        for key in sorted(value):
+            for item in flatten(value[key], prefix + "." + str(key)):
+                yield item
+    elif isinstance(value, list):
+        for index, item in enumerate(value):
+            for entry in flatten(item, "%s[%d]" % (prefix, index)):
+                yield entry
+    elif isinstance(value, (int, long, float)) and \
+            not isinstance(value, bool):
+        yield prefix.lstrip("."), value
+
+
+def compare(results, baseline, threshold):
+    before = dict(flatten(baseline))
+    changes = {}
+
+    for key, value in flatten(results):
+        if key not in before:
+            continue
+
+        old = before[key]
+        change = (value - old) * 100.0 / old if old else 0.0
+        changes[key] = {"baseline": old, "value": value, "change": change}
+
+        flag = "*" if abs(change) > threshold else " "
+        sys.stderr.write("%s %-60s %14.2f %14.2f %+8.1f%%\n" %
+                         (flag, key, old, value, change))
+
+    return changes
+
+
+def main():
+    parser = optparse.OptionParser(usage="%prog [options] [script ...]")
+    parser.add_option("-o", "--output", help="write results to FILE")
+    parser.add_option("-b", "--baseline", help="compare with FILE")
+    parser.add_option("-t", "--threshold", type="float", default=10.0,
+                      help="flag changes above PERCENT [%default]")
+    options, names = parser.parse_args()
+
+    baseline = None
+    if options.baseline:
+        try:
+            baseline = json.load(open(options.baseline))["results"]
+        except (IOError, ValueError), exc:
+            parser.error("cannot use baseline %s: %s" %
+                         (options.baseline, exc))
+        except KeyError:
+            parser.error("%s is not a suite.py output" % options.baseline)
+
+    results = {}
+    for name in names or SCRIPTS:
+        sys.stderr.write("running %s\n" % name)
+        results[name] = run(name)
+
+    output = {"results": results, "uname": list(os.uname())}
+
+    if baseline is not None:
+        output["comparison"] = compare(results, baseline, options.threshold)
+
+    text = json.dumps(output, indent=2, sort_keys=True)
+    if options.output:
+        open(options.output, "w").write(text + "\n")
+    else:
+        print text
+
+
+if __name__ == "__main__":
+    main()
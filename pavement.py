@@ -1,5 +1,8 @@
 import errno
+import glob
 import os
+import sys
+from distutils.sysconfig import get_python_lib
 from setuptools import Extension
 
 from paver.easy import *
@@ -20,6 +23,8 @@ setup(
         include_dirs=['/usr/include'],
         depends=['/usr/include/sys/prctl.h'],
         extra_compile_args=['-Wall'])],
+    # applies the profile named by PRCTL_PROFILE at interpreter startup
+    data_files=[(get_python_lib(prefix=''), ['prctl-profile.pth'])],
     classifiers = [
         "Development Status :: 5 - Production/Stable",
         "Intended Audience :: Developers",
@@ -36,6 +41,7 @@ MANIFEST = (
     "setup.py",
     "paver-minilib.zip",
     "prctlmodule.c",
+    "prctl-profile.pth",
 )
 
 @task
@@ -47,6 +53,30 @@ def manifest():
 def sdist():
     pass
 
+@task
+@needs('setuptools.command.build')
+@cmdopts([
+    ('output=', None, 'write the results to this file'),
+    ('baseline=', None, 'compare with the results in this file'),
+    ('threshold=', None, 'flag changes above this many percent'),
+])
+def bench(options):
+    """Run the benchmarks in bench/ against the freshly built module."""
+    lib = glob.glob('build/lib.*-%d.%d' % sys.version_info[:2])
+    opts = options.bench
+    args = []
+
+    if opts.get('output'):
+        args.extend(['--output', opts.output])
+    if opts.get('baseline'):
+        args.extend(['--baseline', opts.baseline])
+    if opts.get('threshold'):
+        args.extend(['--threshold', opts.threshold])
+
+    os.environ['PYTHONPATH'] = os.pathsep.join(
+        lib + filter(None, [os.environ.get('PYTHONPATH')]))
+    sh(' '.join([sys.executable, 'bench/suite.py'] + args))
+
 @task
 def clean():
     for p in map(path, ('prctl.egg-info', 'dist', 'build', 'MANIFEST.in')):
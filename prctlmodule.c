@@ -30,8 +30,47 @@
  */
 
 #include <Python.h>
+#include <pythread.h>
+#include <structseq.h>
+#include <structmember.h>
 #include <sys/prctl.h>
+#include <sys/auxv.h>
+#include <sys/epoll.h>
 #include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/personality.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <alloca.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define IOPRIO_CLASS_NONE  0
+#define IOPRIO_CLASS_RT    1
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_PRIO_CLASS(ioprio) ((ioprio) >> IOPRIO_CLASS_SHIFT)
+#define IOPRIO_PRIO_DATA(ioprio)  ((ioprio) & ((1 << IOPRIO_CLASS_SHIFT) - 1))
 
 static char module_doc[] =
 "This module provides access to the Linux prctl system call\n\
@@ -53,6 +92,11 @@ Valid Options:\n\n\
              timestamp\n\
   NAME:      Process name\n\
   ENDIAN:    Process endianess\n\
+  TIMERSLACK: Timer slack of the calling thread in nanoseconds\n\
+  CHILD_SUBREAPER: Whether orphaned descendants are reparented to us\n\
+  THP_DISABLE: Disable transparent huge pages for the process\n\
+  IO_FLUSHER: Whether we are part of the I/O path for memory reclaim\n\
+              (needs CAP_SYS_RESOURCE)\n\
 ";
 
 static PyObject *ErrorObject;
@@ -82,6 +126,30 @@ struct table_entry {
 #define MAX_ENTRY PR_ENDIAN
 #endif
 
+#ifdef PR_GET_TIMERSLACK
+#define PR_TIMERSLACK 9
+#undef  MAX_ENTRY
+#define MAX_ENTRY PR_TIMERSLACK
+#endif
+
+#ifdef PR_GET_CHILD_SUBREAPER
+#define PR_CHILD_SUBREAPER 10
+#undef  MAX_ENTRY
+#define MAX_ENTRY PR_CHILD_SUBREAPER
+#endif
+
+#ifdef PR_GET_THP_DISABLE
+#define PR_THP_DISABLE 11
+#undef  MAX_ENTRY
+#define MAX_ENTRY PR_THP_DISABLE
+#endif
+
+#ifdef PR_GET_IO_FLUSHER
+#define PR_IO_FLUSHER 12
+#undef  MAX_ENTRY
+#define MAX_ENTRY PR_IO_FLUSHER
+#endif
+
 #define MAX_LEN 1024 /* well more then maximum kernel size (TASK_COMM_LEN) */
 
 static struct table_entry _option_table[] = {
@@ -95,10 +163,42 @@ static struct table_entry _option_table[] = {
 	{"NAME",      NULL, PR_GET_NAME,      PR_SET_NAME},
 #ifdef PR_ENDIAN
 	{"ENDIAN",    NULL, PR_GET_ENDIAN,    PR_SET_ENDIAN},
+#endif
+#ifdef PR_TIMERSLACK
+	{"TIMERSLACK", NULL, PR_GET_TIMERSLACK, PR_SET_TIMERSLACK},
+#endif
+#ifdef PR_CHILD_SUBREAPER
+	{"CHILD_SUBREAPER", NULL, PR_GET_CHILD_SUBREAPER, PR_SET_CHILD_SUBREAPER},
+#endif
+#ifdef PR_THP_DISABLE
+	{"THP_DISABLE", NULL, PR_GET_THP_DISABLE, PR_SET_THP_DISABLE},
+#endif
+#ifdef PR_IO_FLUSHER
+	{"IO_FLUSHER", NULL, PR_GET_IO_FLUSHER, PR_SET_IO_FLUSHER},
 #endif
 	{NULL, NULL, 0, 0}
 };
 
+static PyObject *_prctl_error(int option)
+{
+#ifdef PR_IO_FLUSHER
+	/* EPERM alone does not say which capability is lacking */
+	if (option == PR_IO_FLUSHER && errno == EPERM) {
+		PyObject *args;
+
+		args = Py_BuildValue("(is)", EPERM,
+				     "IO_FLUSHER requires CAP_SYS_RESOURCE");
+		if (args) {
+			PyErr_SetObject(ErrorObject, args);
+			Py_DECREF(args);
+		}
+		return NULL;
+	}
+#endif
+
+	return PyErr_SetFromErrno(ErrorObject);
+}
+
 static PyObject *_set_prctl(int option, PyObject *value)
 {
 	unsigned long arg;
@@ -137,11 +237,9 @@ static PyObject *_set_prctl(int option, PyObject *value)
 	}
 
 
-	result = prctl(_option_table[option].set, arg);
-	if (result < 0) {
-		PyErr_SetFromErrno(ErrorObject);
-		return NULL;
-	}
+	result = prctl(_option_table[option].set, arg, 0, 0, 0);
+	if (result < 0)
+		return _prctl_error(option);
 
 	Py_INCREF(Py_None);
 	return Py_None;
@@ -155,14 +253,29 @@ static PyObject *_get_prctl(int option)
 
 	memset(arg, 0, MAX_LEN);
 
-	result = prctl(_option_table[option].get, arg);
-	if (result < 0) {
-		PyErr_SetFromErrno(ErrorObject);
-		return NULL;
+	switch (option) {
+#ifdef PR_THP_DISABLE
+	case PR_THP_DISABLE:
+#endif
+#ifdef PR_IO_FLUSHER
+	case PR_IO_FLUSHER:
+#endif
+		/* rejects any argument */
+		result = prctl(_option_table[option].get, 0, 0, 0, 0);
+		break;
+	default:
+		result = prctl(_option_table[option].get, arg, 0, 0, 0);
+		break;
 	}
+
+	if (result < 0)
+		return _prctl_error(option);
 	
 	switch (option) {
 	case PR_PDEATHSIG:
+#ifdef PR_CHILD_SUBREAPER
+	case PR_CHILD_SUBREAPER:
+#endif
 		output = PyInt_FromLong(*(int *)arg);
 		break;
 	case PR_NAME:
@@ -196,27 +309,8480 @@ static PyObject *py_prctl(PyObject *self, PyObject *args)
 }
 
 
-static PyMethodDef _prctl_methods[] = {
-	{"prctl", py_prctl, METH_VARARGS, prctl_doc},
-	{NULL, NULL, 0, NULL}
+/*
+ * Fallbacks for prctl(2) options the extensions below use unconditionally,
+ * so that they build against headers older than the options. The option
+ * table above keeps testing the headers; a kernel without an option
+ * still fails the call with EINVAL.
+ */
+#ifndef PR_SET_TIMERSLACK
+#define PR_SET_TIMERSLACK 29
+#define PR_GET_TIMERSLACK 30
+#endif
+
+#ifndef PR_GET_CHILD_SUBREAPER
+#define PR_SET_CHILD_SUBREAPER 36
+#define PR_GET_CHILD_SUBREAPER 37
+#endif
+
+#ifndef PR_TASK_PERF_EVENTS_DISABLE
+#define PR_TASK_PERF_EVENTS_DISABLE 31
+#define PR_TASK_PERF_EVENTS_ENABLE  32
+#endif
+
+#ifndef PR_SET_THP_DISABLE
+#define PR_SET_THP_DISABLE 41
+#define PR_GET_THP_DISABLE 42
+#endif
+
+#ifndef PR_GET_SPECULATION_CTRL
+#define PR_GET_SPECULATION_CTRL 52
+#define PR_SET_SPECULATION_CTRL 53
+#define PR_SPEC_STORE_BYPASS    0
+#define PR_SPEC_INDIRECT_BRANCH 1
+#define PR_SPEC_ENABLE          (1UL << 1)
+#define PR_SPEC_DISABLE         (1UL << 2)
+#define PR_SPEC_FORCE_DISABLE   (1UL << 3)
+#endif
+
+#ifndef PR_SPEC_DISABLE_NOEXEC
+#define PR_SPEC_DISABLE_NOEXEC  (1UL << 4)
+#endif
+
+#ifndef PR_SPEC_L1D_FLUSH
+#define PR_SPEC_L1D_FLUSH 2
+#endif
+
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#define PR_GET_MEMORY_MERGE 68
+#endif
+
+#ifndef PR_SET_PTRACER
+#define PR_SET_PTRACER     0x59616d61
+#define PR_SET_PTRACER_ANY ((unsigned long)-1)
+#endif
+
+/*
+ * Zygote (fork server) support.
+ *
+ * A zygote is a small, already imported process which sits on a unix
+ * socket and forks a fresh worker whenever a request arrives. The
+ * per-worker attributes travel in the request and are applied in C in
+ * the child before it returns to Python, while the requester receives
+ * the child's pid and, where the kernel supports it, a pidfd.
+ *
+ * When the requester is the zygote's own parent and a child subreaper,
+ * the worker is forked from a short-lived intermediate which exits
+ * straight away, so the worker is reparented to the requester. It can
+ * then wait for it, collect its exit status and use the pidfd with
+ * waitid(P_PIDFD) or a Reaper. Both forks go through fork(3), so the
+ * atfork handlers of libc and of this module run as usual. Workers of
+ * any other requester stay with the zygote, which reaps them.
+ */
+#define ZYGOTE_MAGIC       0x7a79676f /* "zygo" */
+#define ZYGOTE_PAYLOAD_MAX 4096
+#define ZYGOTE_MAX_CONN    64
+#define ZYGOTE_REAP_MS     1000
+
+#define ZYGOTE_PDEATHSIG   (1 << 0)
+#define ZYGOTE_NAME        (1 << 1)
+#define ZYGOTE_TIMERSLACK  (1 << 2)
+#define ZYGOTE_AFFINITY    (1 << 3)
+#define ZYGOTE_DUMPABLE    (1 << 4)
+#define ZYGOTE_NICE        (1 << 5)
+#define ZYGOTE_IOPRIO      (1 << 6)
+#define ZYGOTE_REPARENT    (1 << 7)
+
+struct zygote_request {
+	unsigned int  magic;
+	unsigned int  flags;
+	int           pdeathsig;
+	int           dumpable;
+	int           nice;
+	int           ioprio;
+	unsigned long timerslack;
+	char          name[16];
+	cpu_set_t     affinity;
+	unsigned int  length;
+	char          payload[ZYGOTE_PAYLOAD_MAX];
 };
 
-PyMODINIT_FUNC initprctl(void)
+struct zygote_reply {
+	unsigned int magic;
+	int          pid;
+	int          error;
+};
+
+static char zygote_serve_doc[] =
+"zygote_serve(fd) -> payload or None\n\n\
+Serve fork requests from zygote_spawn() on the unix socket fd. The fd\n\
+may either be a connected socket or a listening socket, in which case\n\
+connections are accepted as they arrive. In the zygote the call\n\
+returns None once every requester has hung up and, for a listening\n\
+socket, the socket has been shut down with shutdown(2). In each forked\n\
+child it returns the payload string supplied to zygote_spawn(), after\n\
+the requested attributes have been applied and the zygote's sockets\n\
+closed.\n\n\
+If the process which started the zygote is a child subreaper\n\
+(prctl(CHILD_SUBREAPER, 1)), the children it requests are reparented to\n\
+it: it must reap them, and a requested PDEATHSIG fires when it exits.\n\
+Children of any other requester remain children of the zygote, which\n\
+reaps them and discards their status; other children of the zygote\n\
+process are left alone.\n\
+";
+
+static char zygote_spawn_doc[] =
+"zygote_spawn(fd, payload='', pdeathsig=None, name=None, timerslack=None,\n\
+             affinity=None, dumpable=None, nice=None, ioprio=None)\n\
+    -> (pid, pidfd)\n\n\
+Ask the zygote listening on the other end of fd to fork a child. The\n\
+attributes which are not None are applied in the child before it\n\
+returns to Python; affinity is a sequence of cpu numbers and ioprio an\n\
+(ioclass, level) tuple as taken by ioprio_set(). pidfd is\n\
+None when the kernel lacks pidfd_open(2).\n\
+";
+
+static int _cpuset_from_seq(PyObject *seq, cpu_set_t *set)
 {
-	PyObject *module;
-	PyObject *dict;
-	int i = 0;
+	PyObject *fast;
+	Py_ssize_t i;
+	long cpu;
 
-	module = Py_InitModule3("prctl", _prctl_methods, module_doc);
-	if (!module)
+	fast = PySequence_Fast(seq, "cpu list must be a sequence");
+	if (!fast)
+		return -1;
+
+	CPU_ZERO(set);
+
+	for (i = 0; i < PySequence_Fast_GET_SIZE(fast); i++) {
+		cpu = PyInt_AsLong(PySequence_Fast_GET_ITEM(fast, i));
+		if (cpu == -1 && PyErr_Occurred())
+			goto error;
+
+		if (cpu < 0 || cpu >= CPU_SETSIZE) {
+			PyErr_SetString(PyExc_ValueError, "invalid cpu number");
+			goto error;
+		}
+
+		CPU_SET(cpu, set);
+	}
+
+	Py_DECREF(fast);
+	return 0;
+error:
+	Py_DECREF(fast);
+	return -1;
+}
+
+/*
+ * Runs in the freshly forked child, no Python calls allowed. Returns
+ * zero or the errno of the first attribute which could not be applied.
+ */
+static int _zygote_apply(struct zygote_request *req, pid_t parent)
+{
+	if (req->flags & ZYGOTE_PDEATHSIG) {
+		if (prctl(PR_SET_PDEATHSIG, req->pdeathsig) < 0)
+			return errno;
+		/*
+		 * The zygote may have died between fork and prctl, in which
+		 * case nobody is going to deliver the signal for us.
+		 */
+		if (getppid() != parent)
+			kill(getpid(), req->pdeathsig);
+	}
+
+	if (req->flags & ZYGOTE_NAME &&
+	    prctl(PR_SET_NAME, (unsigned long)req->name) < 0)
+		return errno;
+
+	if (req->flags & ZYGOTE_TIMERSLACK &&
+	    prctl(PR_SET_TIMERSLACK, req->timerslack) < 0)
+		return errno;
+
+	if (req->flags & ZYGOTE_DUMPABLE &&
+	    prctl(PR_SET_DUMPABLE, req->dumpable) < 0)
+		return errno;
+
+	if (req->flags & ZYGOTE_NICE &&
+	    setpriority(PRIO_PROCESS, 0, req->nice) < 0)
+		return errno;
+
+	if (req->flags & ZYGOTE_IOPRIO &&
+	    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, req->ioprio) < 0)
+		return errno;
+
+	if (req->flags & ZYGOTE_AFFINITY &&
+	    sched_setaffinity(0, sizeof(cpu_set_t), &req->affinity) < 0)
+		return errno;
+
+	return 0;
+}
+
+static int _zygote_reply(int fd, pid_t pid, int error, int pidfd)
+{
+	struct zygote_reply reply;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+
+	reply.magic = ZYGOTE_MAGIC;
+	reply.pid   = pid;
+	reply.error = error;
+
+	iov.iov_base = &reply;
+	iov.iov_len  = sizeof(reply);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+
+	if (pidfd >= 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pidfd, sizeof(int));
+	}
+
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/*
+ * Fork a child for the request, recording it in workers unless it is
+ * handed to the requester. Returns the payload in the child, NULL with
+ * an exception set on error and Py_None in the zygote.
+ */
+static PyObject *_zygote_fork(struct zygote_request *req, int conn,
+			      struct pollfd *fds, int nfds, PyObject *workers)
+{
+	socklen_t len = sizeof(struct ucred);
+	struct ucred peer;
+	pid_t parent = getpid();
+	pid_t middle = -1;
+	int reparent = 0;
+	int subreaper = 0;
+	int status[2];
+	int error = 0;
+	int pidfd = -1;
+	PyObject *key;
+	pid_t pid;
+	int i;
+
+	if (req->flags & ZYGOTE_REPARENT &&
+	    !prctl(PR_GET_CHILD_SUBREAPER, (unsigned long)&subreaper) &&
+	    !subreaper &&
+	    !getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &len) &&
+	    peer.pid > 0 && peer.pid == getppid()) {
+		reparent = 1;
+		parent   = peer.pid;
+	}
+
+	if (pipe(status) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	_PyImport_AcquireLock();
+	pid = fork();
+	if (!pid && reparent) {
+		/*
+		 * The intermediate: report the worker's pid and leave, so
+		 * the worker is reparented to the requester, the nearest
+		 * subreaper above it.
+		 */
+		middle = getpid();
+		pid = fork();
+		if (pid) {
+			/* the worker reports its own error after this */
+			error = errno;
+			if (write(status[1], &pid, sizeof(pid)) < 0 ||
+			    (pid < 0 && write(status[1], &error,
+					      sizeof(error)) < 0))
+				_exit(127);
+			_exit(0);
+		}
+		while (getppid() == middle)
+			usleep(100);
+	}
+	if (!pid) {
+		close(status[0]);
+
+		error = _zygote_apply(req, parent);
+		if (write(status[1], &error, sizeof(error)) < 0 || error)
+			_exit(127);
+
+		close(status[1]);
+
+		for (i = 0; i < nfds; i++)
+			close(fds[i].fd);
+
+		PyOS_AfterFork();
+		return PyString_FromStringAndSize(req->payload, req->length);
+	}
+
+	if (_PyImport_ReleaseLock() <= 0) {
+		PyErr_SetString(PyExc_RuntimeError, "not holding the import lock");
+		close(status[0]);
+		close(status[1]);
+		return NULL;
+	}
+
+	close(status[1]);
+
+	if (pid < 0) {
+		error = errno;
+		close(status[0]);
+		goto reply;
+	}
+
+	if (reparent) {
+		middle = pid;
+		if (read(status[0], &pid, sizeof(pid)) != sizeof(pid))
+			pid = -1;
+		waitpid(middle, NULL, 0);
+	}
+
+	if (read(status[0], &error, sizeof(error)) != sizeof(error))
+		error = error ? error : ECHILD;
+	close(status[0]);
+
+	if (error) {
+		/* A reparented worker is reaped by the requester. */
+		if (!reparent && pid > 0) {
+			waitpid(pid, NULL, 0);
+			pid = -1;
+		}
+		goto reply;
+	}
+
+	if (!reparent) {
+		key = PyInt_FromLong(pid);
+		if (!key || PySet_Add(workers, key) < 0)
+			PyErr_Clear();
+		Py_XDECREF(key);
+	}
+
+	pidfd = syscall(SYS_pidfd_open, pid, 0);
+reply:
+	_zygote_reply(conn, pid, error, pidfd);
+	if (pidfd >= 0)
+		close(pidfd);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/* Reap the exited workers the zygote kept, and no other children. */
+static void _zygote_reap(PyObject *workers)
+{
+	PyObject *pids, *key;
+	Py_ssize_t i;
+
+	if (!PySet_GET_SIZE(workers))
 		return;
 
-	dict = PyModule_GetDict(module);
-	if (!dict)
+	pids = PySequence_List(workers);
+	if (!pids) {
+		PyErr_Clear();
 		return;
+	}
 
-	ErrorObject = PyErr_NewException("prctl.PrctlError", NULL, NULL);
-	PyDict_SetItemString(dict, "PrctlError", ErrorObject);
+	for (i = 0; i < PyList_GET_SIZE(pids); i++) {
+		key = PyList_GET_ITEM(pids, i);
+		if (waitpid(PyInt_AsLong(key), NULL, WNOHANG) != 0)
+			PySet_Discard(workers, key);
+	}
+
+	Py_DECREF(pids);
+}
+
+static PyObject *py_zygote_serve(PyObject *self, PyObject *args)
+{
+	struct pollfd fds[ZYGOTE_MAX_CONN + 1];
+	struct zygote_request req;
+	PyObject *workers, *result = NULL;
+	socklen_t len = sizeof(int);
+	int listening = 0;
+	ssize_t got;
+	int nfds = 1;
+	int ready;
+	int conn;
+	int fd;
+	int i;
+
+	if (!PyArg_ParseTuple(args, "i", &fd))
+		return NULL;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	workers = PySet_New(NULL);
+	if (!workers)
+		return NULL;
+
+	fds[0].fd     = fd;
+	fds[0].events = POLLIN;
+
+	while (nfds) {
+		Py_BEGIN_ALLOW_THREADS
+		ready = poll(fds, nfds, ZYGOTE_REAP_MS);
+		Py_END_ALLOW_THREADS
+
+		_zygote_reap(workers);
+
+		if (ready < 0) {
+			if (errno != EINTR) {
+				PyErr_SetFromErrno(ErrorObject);
+				goto out;
+			}
+			if (PyErr_CheckSignals())
+				goto out;
+			continue;
+		}
+
+		for (i = nfds - 1; ready && i >= 0; i--) {
+			if (!fds[i].revents)
+				continue;
+
+			ready--;
+
+			if (listening && !i) {
+				conn = -1;
+				if (!(fds[0].revents & POLLHUP))
+					conn = accept(fd, NULL, NULL);
+
+				/* shut down: serve the open connections out */
+				if (conn < 0 && (fds[0].revents & POLLHUP ||
+						 errno == EINVAL)) {
+					listening = 0;
+					fds[0] = fds[--nfds];
+					continue;
+				}
+
+				if (conn < 0 || nfds > ZYGOTE_MAX_CONN) {
+					if (conn >= 0)
+						close(conn);
+					continue;
+				}
+
+				fds[nfds].fd      = conn;
+				fds[nfds].events  = POLLIN;
+				fds[nfds].revents = 0;
+				nfds++;
+				continue;
+			}
+
+			conn = fds[i].fd;
+
+			Py_BEGIN_ALLOW_THREADS
+			got = recv(conn, &req, sizeof(req), MSG_WAITALL);
+			Py_END_ALLOW_THREADS
+
+			if (got != sizeof(req) || req.magic != ZYGOTE_MAGIC ||
+			    req.length > ZYGOTE_PAYLOAD_MAX) {
+				if (conn != fd)
+					close(conn);
+				fds[i] = fds[--nfds];
+				continue;
+			}
+
+			result = _zygote_fork(&req, conn, fds, nfds, workers);
+			if (result != Py_None)
+				goto out;
+
+			Py_CLEAR(result);
+		}
+	}
+
+	Py_INCREF(Py_None);
+	result = Py_None;
+out:
+	Py_DECREF(workers);
+	return result;
+}
+
+static PyObject *py_zygote_spawn(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"fd", "payload", "pdeathsig", "name",
+				 "timerslack", "affinity", "dumpable", "nice",
+				 "ioprio", NULL};
+	PyObject *pdeathsig = Py_None, *name = Py_None, *slack = Py_None;
+	PyObject *affinity = Py_None, *dumpable = Py_None, *nice = Py_None;
+	PyObject *ioprio = Py_None;
+	int ioclass, level = -1;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct zygote_request req;
+	struct zygote_reply reply;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char *payload = "";
+	int subreaper = 0;
+	int length = 0;
+	int pidfd = -1;
+	int fd;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "i|s#OOOOOOO", kwlist,
+					 &fd, &payload, &length, &pdeathsig,
+					 &name, &slack, &affinity, &dumpable,
+					 &nice, &ioprio))
+		return NULL;
+
+	if (length > ZYGOTE_PAYLOAD_MAX) {
+		PyErr_SetString(PyExc_ValueError, "payload too large");
+		return NULL;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.magic  = ZYGOTE_MAGIC;
+	req.length = length;
+	memcpy(req.payload, payload, length);
+
+	if (pdeathsig != Py_None) {
+		req.flags |= ZYGOTE_PDEATHSIG;
+		req.pdeathsig = PyInt_AsLong(pdeathsig);
+	}
+	if (name != Py_None) {
+		if (!PyString_Check(name)) {
+			PyErr_SetString(PyExc_TypeError, "name must be a string");
+			return NULL;
+		}
+		req.flags |= ZYGOTE_NAME;
+		strncpy(req.name, PyString_AS_STRING(name), sizeof(req.name) - 1);
+	}
+	if (slack != Py_None) {
+		req.flags |= ZYGOTE_TIMERSLACK;
+		req.timerslack = PyInt_AsUnsignedLongMask(slack);
+	}
+	if (dumpable != Py_None) {
+		req.flags |= ZYGOTE_DUMPABLE;
+		req.dumpable = PyInt_AsLong(dumpable);
+	}
+	if (nice != Py_None) {
+		req.flags |= ZYGOTE_NICE;
+		req.nice = PyInt_AsLong(nice);
+	}
+	if (ioprio != Py_None) {
+		if (!PyArg_ParseTuple(ioprio, "i|i", &ioclass, &level))
+			return NULL;
+		if (level < 0)
+			level = ioclass == IOPRIO_CLASS_RT ||
+				ioclass == IOPRIO_CLASS_BE ? 4 : 0;
+		req.flags |= ZYGOTE_IOPRIO;
+		req.ioprio = IOPRIO_PRIO_VALUE(ioclass, level);
+	}
+	if (PyErr_Occurred())
+		return NULL;
+
+	if (affinity != Py_None) {
+		req.flags |= ZYGOTE_AFFINITY;
+		if (_cpuset_from_seq(affinity, &req.affinity) < 0)
+			return NULL;
+	}
+
+	if (!prctl(PR_GET_CHILD_SUBREAPER, (unsigned long)&subreaper) &&
+	    subreaper)
+		req.flags |= ZYGOTE_REPARENT;
+
+	iov.iov_base = &reply;
+	iov.iov_len  = sizeof(reply);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control;
+	msg.msg_controllen = sizeof(control);
+
+	Py_BEGIN_ALLOW_THREADS
+	rc = send(fd, &req, sizeof(req), MSG_NOSIGNAL);
+	if (rc == sizeof(req))
+		rc = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	Py_END_ALLOW_THREADS
+
+	if (rc < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	if (rc != sizeof(reply) || reply.magic != ZYGOTE_MAGIC) {
+		PyErr_SetString(ErrorObject, "zygote closed the connection");
+		return NULL;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&pidfd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (reply.error) {
+		if (pidfd >= 0)
+			close(pidfd);
+		/* A failed child reparented to us is ours to reap. */
+		if (reply.pid > 0)
+			waitpid(reply.pid, NULL, 0);
+		errno = reply.error;
+		return PyErr_SetFromErrno(ErrorObject);
+	}
+
+	if (pidfd < 0)
+		return Py_BuildValue("(iO)", reply.pid, Py_None);
+
+	return Py_BuildValue("(ii)", reply.pid, pidfd);
+}
+
+
+static long long _monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * epoll_wait(2) for up to timeout seconds, forever if negative, with the
+ * GIL released. An interrupted wait runs the signal handlers and goes
+ * on with the time left. Returns the event count or -1 with an
+ * exception set.
+ */
+static int _epoll_wait_signals(int epfd, struct epoll_event *events,
+			       int max, double timeout)
+{
+	long long deadline = _monotonic_ns() + (long long)(timeout * 1e9);
+	int ms = timeout < 0 ? -1 : (int)(timeout * 1000);
+	int rc;
+
+	for (;;) {
+		Py_BEGIN_ALLOW_THREADS
+		rc = epoll_wait(epfd, events, max, ms);
+		Py_END_ALLOW_THREADS
+
+		if (rc >= 0 || errno != EINTR)
+			break;
+		if (PyErr_CheckSignals())
+			return -1;
+
+		if (timeout >= 0) {
+			ms = (deadline - _monotonic_ns()) / 1000000;
+			if (ms < 0)
+				ms = 0;
+		}
+	}
+
+	if (rc < 0)
+		PyErr_SetFromErrno(ErrorObject);
+	return rc;
+}
+
+
+/*
+ * Child reaping through pidfds.
+ *
+ * A Reaper owns an epoll descriptor into which the pidfds of tracked
+ * children are registered, so a supervisor can poll a single fd and
+ * collect every exit that happened since the last wakeup in one call,
+ * together with the resource usage of each child.
+ */
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+#define REAPER_BATCH 256
+
+typedef struct {
+	PyObject_HEAD
+	int       epfd;
+	PyObject *children; /* pid -> pidfd */
+} ReaperObject;
+
+static PyTypeObject ReaperType;
+static PyTypeObject ChildExitType;
+
+static PyStructSequence_Field child_exit_fields[] = {
+	{"pid",    "process id of the child"},
+	{"code",   "CLD_* reason, None if the child was not ours to wait"},
+	{"status", "exit status or signal number"},
+	{"utime",  "user time in seconds"},
+	{"stime",  "system time in seconds"},
+	{"maxrss", "maximum resident set size in kilobytes"},
+	{"minflt", "minor page faults"},
+	{"majflt", "major page faults"},
+	{"nvcsw",  "voluntary context switches"},
+	{"nivcsw", "involuntary context switches"},
+	{NULL}
+};
+
+static PyStructSequence_Desc child_exit_desc = {
+	"prctl.ChildExit",
+	"Exit status and resource usage of a reaped child",
+	child_exit_fields,
+	10,
+};
+
+static char reaper_doc[] =
+"Reaper() -> reaper object\n\n\
+Track children through pidfds and collect their exit status in batches.\n\
+The object's fileno() becomes readable whenever a tracked child exits\n\
+and may be handed to select, epoll or an event loop.\n\
+";
+
+static PyObject *_child_exit(siginfo_t *info, struct rusage *ru, pid_t pid)
+{
+	PyObject *result;
+
+	result = PyStructSequence_New(&ChildExitType);
+	if (!result)
+		return NULL;
+
+	if (info) {
+		PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(info->si_pid));
+		PyStructSequence_SET_ITEM(result, 1, PyInt_FromLong(info->si_code));
+		PyStructSequence_SET_ITEM(result, 2, PyInt_FromLong(info->si_status));
+	} else {
+		PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(pid));
+		Py_INCREF(Py_None);
+		PyStructSequence_SET_ITEM(result, 1, Py_None);
+		Py_INCREF(Py_None);
+		PyStructSequence_SET_ITEM(result, 2, Py_None);
+	}
+
+	PyStructSequence_SET_ITEM(result, 3, PyFloat_FromDouble(
+		ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6));
+	PyStructSequence_SET_ITEM(result, 4, PyFloat_FromDouble(
+		ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6));
+	PyStructSequence_SET_ITEM(result, 5, PyInt_FromLong(ru->ru_maxrss));
+	PyStructSequence_SET_ITEM(result, 6, PyInt_FromLong(ru->ru_minflt));
+	PyStructSequence_SET_ITEM(result, 7, PyInt_FromLong(ru->ru_majflt));
+	PyStructSequence_SET_ITEM(result, 8, PyInt_FromLong(ru->ru_nvcsw));
+	PyStructSequence_SET_ITEM(result, 9, PyInt_FromLong(ru->ru_nivcsw));
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+static PyObject *Reaper_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	ReaperObject *self;
+
+	if (!PyArg_ParseTuple(args, ":Reaper"))
+		return NULL;
+
+	self = (ReaperObject *)type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+	self->epfd = -1;
+
+	self->children = PyDict_New();
+	if (!self->children) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	self->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (self->epfd < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+static void _reaper_close(ReaperObject *self)
+{
+	PyObject *key, *value;
+	Py_ssize_t pos = 0;
+
+	if (self->children) {
+		while (PyDict_Next(self->children, &pos, &key, &value))
+			close(PyInt_AsLong(value));
+		PyDict_Clear(self->children);
+	}
+
+	if (self->epfd >= 0)
+		close(self->epfd);
+	self->epfd = -1;
+}
+
+static void Reaper_dealloc(ReaperObject *self)
+{
+	_reaper_close(self);
+	Py_XDECREF(self->children);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int _reaper_forget(ReaperObject *self, pid_t pid)
+{
+	PyObject *key, *value;
+	int rc = 0;
+
+	key = PyInt_FromLong(pid);
+	if (!key)
+		return -1;
+
+	value = PyDict_GetItem(self->children, key);
+	if (value) {
+		/*
+		 * Forked children may still share the pidfd, which would
+		 * keep it registered after close, so remove it explicitly.
+		 */
+		epoll_ctl(self->epfd, EPOLL_CTL_DEL, PyInt_AsLong(value), NULL);
+		close(PyInt_AsLong(value));
+		rc = PyDict_DelItem(self->children, key);
+	}
+
+	Py_DECREF(key);
+	return rc;
+}
+
+static PyObject *Reaper_add(ReaperObject *self, PyObject *args)
+{
+	struct epoll_event event;
+	PyObject *value;
+	int pidfd = -1;
+	int pid;
+
+	if (!PyArg_ParseTuple(args, "i|i:add", &pid, &pidfd))
+		return NULL;
+
+	if (self->epfd < 0) {
+		PyErr_SetString(PyExc_ValueError, "reaper is closed");
+		return NULL;
+	}
+
+	if (pidfd < 0)
+		pidfd = syscall(SYS_pidfd_open, pid, 0);
+	else
+		pidfd = fcntl(pidfd, F_DUPFD_CLOEXEC, 0);
+	if (pidfd < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	/* a pid added again, say after reuse, replaces the old pidfd */
+	if (_reaper_forget(self, pid) < 0) {
+		close(pidfd);
+		return NULL;
+	}
+
+	event.events   = EPOLLIN;
+	event.data.u64 = ((unsigned long long)pid << 32) | (unsigned)pidfd;
+
+	if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, pidfd, &event) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		close(pidfd);
+		return NULL;
+	}
+
+	value = PyInt_FromLong(pidfd);
+	if (!value || PyDict_SetItem(self->children, PyTuple_GET_ITEM(args, 0),
+				     value) < 0) {
+		Py_XDECREF(value);
+		close(pidfd);
+		return NULL;
+	}
+
+	Py_DECREF(value);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *Reaper_remove(ReaperObject *self, PyObject *args)
+{
+	int pid;
+
+	if (!PyArg_ParseTuple(args, "i:remove", &pid))
+		return NULL;
+
+	if (_reaper_forget(self, pid) < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *Reaper_reap(ReaperObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"timeout", "all", NULL};
+	struct epoll_event events[REAPER_BATCH];
+	PyObject *result, *item;
+	struct rusage ru;
+	siginfo_t info;
+	double timeout = 0.0;
+	int all = 0;
+	int pidfd;
+	int rc;
+	int i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|di:reap", kwlist,
+					 &timeout, &all))
+		return NULL;
+
+	if (self->epfd < 0) {
+		PyErr_SetString(PyExc_ValueError, "reaper is closed");
+		return NULL;
+	}
+
+	rc = _epoll_wait_signals(self->epfd, events, REAPER_BATCH, timeout);
+	if (rc < 0)
+		return NULL;
+
+	result = PyList_New(0);
+	if (!result)
+		return NULL;
+
+	for (i = 0; i < rc; i++) {
+		pidfd = (int)(events[i].data.u64 & 0xffffffff);
+
+		memset(&info, 0, sizeof(info));
+		memset(&ru, 0, sizeof(ru));
+
+		if (syscall(SYS_waitid, P_PIDFD, pidfd, &info,
+			    WEXITED | WNOHANG, &ru) < 0) {
+			if (errno != ECHILD)
+				goto error;
+			/* not our child, all we know is that it is gone */
+			item = _child_exit(NULL, &ru, events[i].data.u64 >> 32);
+		} else if (!info.si_pid) {
+			continue;
+		} else
+			item = _child_exit(&info, &ru, 0);
+
+		if (!item || PyList_Append(result, item) < 0) {
+			Py_XDECREF(item);
+			goto error;
+		}
+		Py_DECREF(item);
+
+		if (_reaper_forget(self, events[i].data.u64 >> 32) < 0)
+			goto error;
+	}
+
+	while (all) {
+		memset(&info, 0, sizeof(info));
+		memset(&ru, 0, sizeof(ru));
+
+		if (syscall(SYS_waitid, P_ALL, 0, &info,
+			    WEXITED | WNOHANG, &ru) < 0) {
+			if (errno == ECHILD)
+				break;
+			goto error;
+		}
+
+		if (!info.si_pid)
+			break;
+
+		item = _child_exit(&info, &ru, 0);
+		if (!item || PyList_Append(result, item) < 0) {
+			Py_XDECREF(item);
+			goto error;
+		}
+		Py_DECREF(item);
+
+		if (_reaper_forget(self, info.si_pid) < 0)
+			goto error;
+	}
+
+	return result;
+error:
+	if (!PyErr_Occurred())
+		PyErr_SetFromErrno(ErrorObject);
+	Py_DECREF(result);
+	return NULL;
+}
+
+static PyObject *Reaper_fileno(ReaperObject *self)
+{
+	return PyInt_FromLong(self->epfd);
+}
+
+static PyObject *Reaper_close(ReaperObject *self)
+{
+	_reaper_close(self);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static Py_ssize_t Reaper_length(ReaperObject *self)
+{
+	return PyDict_Size(self->children);
+}
+
+static PyMethodDef Reaper_methods[] = {
+	{"add", (PyCFunction)Reaper_add, METH_VARARGS,
+	 "add(pid, [pidfd]) -> None\n\nTrack pid, opening a pidfd for it unless one is given.\n\
+Adding a pid again replaces its previous pidfd."},
+	{"remove", (PyCFunction)Reaper_remove, METH_VARARGS,
+	 "remove(pid) -> None\n\nStop tracking pid."},
+	{"reap", (PyCFunction)Reaper_reap, METH_VARARGS | METH_KEYWORDS,
+	 "reap(timeout=0.0, all=False) -> [ChildExit, ...]\n\n\
+Wait up to timeout seconds (forever if negative) for tracked children\n\
+to exit and collect all of them with waitid(2). With all set, also\n\
+collect any other exited child, such as orphans reparented to a\n\
+CHILD_SUBREAPER."},
+	{"fileno", (PyCFunction)Reaper_fileno, METH_NOARGS,
+	 "fileno() -> int\n\nThe pollable epoll descriptor."},
+	{"close", (PyCFunction)Reaper_close, METH_NOARGS,
+	 "close() -> None\n\nClose the epoll descriptor and all pidfds."},
+	{NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods Reaper_as_sequence = {
+	(lenfunc)Reaper_length,
+};
+
+static PyTypeObject ReaperType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"prctl.Reaper",
+	sizeof(ReaperObject),
+	0,
+	(destructor)Reaper_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	&Reaper_as_sequence,			/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	reaper_doc,				/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	Reaper_methods,				/* tp_methods */
+	0,					/* tp_members */
+	0,					/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	0,					/* tp_init */
+	0,					/* tp_alloc */
+	Reaper_new,				/* tp_new */
+};
+
+
+/*
+ * Scoped attribute changes.
+ *
+ * Several calls have a scoped form: a context manager which applies a
+ * change on __enter__ and restores the previous setting on __exit__.
+ * They share one type, parameterised with the operations to run and a
+ * small buffer for the saved C-level state.
+ */
+typedef struct ScopeObject ScopeObject;
+
+struct scope_ops {
+	int (*enter)(ScopeObject *self);
+	int (*exit)(ScopeObject *self);
+};
+
+struct ScopeObject {
+	PyObject_HEAD
+	struct scope_ops *ops;
+	pid_t             target;
+	PyObject         *kw;     /* arguments of the change */
+	PyObject         *value;  /* returned by __enter__ */
+	PyObject         *owner;  /* object the scope reports back to */
+	int               slot;   /* index into the owner */
+	int               active;
+	unsigned int      given;
+	long long         state[16];
+};
+
+static PyTypeObject ScopeType;
+
+static PyObject *_scope_new(struct scope_ops *ops, pid_t target, PyObject *kw)
+{
+	ScopeObject *self;
+
+	self = PyObject_New(ScopeObject, &ScopeType);
+	if (!self)
+		return NULL;
+
+	self->ops    = ops;
+	self->target = target;
+	self->kw     = kw ? kw : PyDict_New();
+	self->value  = NULL;
+	self->owner  = NULL;
+	self->slot   = 0;
+	self->active = 0;
+	self->given  = 0;
+	memset(self->state, 0, sizeof(self->state));
+
+	if (!self->kw) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	if (kw)
+		Py_INCREF(kw);
+
+	return (PyObject *)self;
+}
+
+static void Scope_dealloc(ScopeObject *self)
+{
+	Py_XDECREF(self->kw);
+	Py_XDECREF(self->value);
+	Py_XDECREF(self->owner);
+	PyObject_Del(self);
+}
+
+static PyObject *Scope_enter(ScopeObject *self)
+{
+	if (self->active) {
+		PyErr_SetString(PyExc_RuntimeError, "scope already entered");
+		return NULL;
+	}
+
+	Py_CLEAR(self->value);
+
+	if (self->ops->enter(self) < 0)
+		return NULL;
+
+	self->active = 1;
+
+	if (!self->value) {
+		Py_INCREF(self);
+		return (PyObject *)self;
+	}
+
+	Py_INCREF(self->value);
+	return self->value;
+}
+
+static PyObject *Scope_exit(ScopeObject *self, PyObject *args)
+{
+	if (self->active) {
+		self->active = 0;
+		if (self->ops->exit(self) < 0)
+			return NULL;
+	}
+
+	Py_INCREF(Py_False);
+	return Py_False;
+}
+
+static PyMethodDef Scope_methods[] = {
+	{"__enter__", (PyCFunction)Scope_enter, METH_NOARGS, NULL},
+	{"__exit__",  (PyCFunction)Scope_exit,  METH_VARARGS, NULL},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject ScopeType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"prctl.Scope",
+	sizeof(ScopeObject),
+	0,
+	(destructor)Scope_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	PyObject_GenericGetAttr,		/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	"Context manager restoring a setting on exit",	/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	Scope_methods,				/* tp_methods */
+};
+
+/*
+ * Threads are named either by their native TID or by a threading.Thread
+ * object. Python 2 threads do not record their TID, so unless the object
+ * carries a native_id only the calling thread can be resolved from it.
+ */
+static PyObject *_gettid(PyObject *self)
+{
+	return PyInt_FromLong(syscall(SYS_gettid));
+}
+
+static char gettid_doc[] =
+"gettid() -> int\n\n\
+Return the native thread id (TID) of the calling thread.\n\
+";
+
+static int _resolve_tid(PyObject *thread, pid_t *tid)
+{
+	PyObject *value;
+	long ident;
+
+	*tid = 0;
+
+	if (!thread || thread == Py_None)
+		return 0;
+
+	if (PyInt_Check(thread) || PyLong_Check(thread)) {
+		*tid = PyInt_AsLong(thread);
+		return PyErr_Occurred() ? -1 : 0;
+	}
+
+	value = PyObject_GetAttrString(thread, "native_id");
+	if (value && value != Py_None) {
+		*tid = PyInt_AsLong(value);
+		Py_DECREF(value);
+		return PyErr_Occurred() ? -1 : 0;
+	}
+	Py_XDECREF(value);
+	PyErr_Clear();
+
+	value = PyObject_GetAttrString(thread, "ident");
+	if (!value)
+		return -1;
+
+	ident = PyInt_AsLong(value);
+	Py_DECREF(value);
+
+	if (ident == -1 && PyErr_Occurred())
+		return -1;
+
+	if (ident == PyThread_get_thread_ident())
+		return 0;
+
+	PyErr_SetString(PyExc_ValueError,
+			"cannot resolve the TID of another thread, pass the "
+			"value of gettid() from that thread instead");
+	return -1;
+}
+
+/*
+ * Per-thread scheduling attributes through sched_setattr(2), which
+ * glibc does not wrap.
+ */
+#ifndef SCHED_BATCH
+#define SCHED_BATCH 3
+#endif
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+#define SCHED_FLAG_RESET_ON_FORK  0x01
+#define SCHED_FLAG_KEEP_POLICY    0x08
+#define SCHED_FLAG_KEEP_PARAMS    0x10
+#define SCHED_FLAG_UTIL_CLAMP_MIN 0x20
+#define SCHED_FLAG_UTIL_CLAMP_MAX 0x40
+
+#define SCHED_GIVEN_POLICY   (1 << 0)
+#define SCHED_GIVEN_PRIORITY (1 << 1)
+#define SCHED_GIVEN_NICE     (1 << 2)
+#define SCHED_GIVEN_DL       (1 << 3)
+#define SCHED_GIVEN_UTIL_MIN (1 << 4)
+#define SCHED_GIVEN_UTIL_MAX (1 << 5)
+#define SCHED_GIVEN_RESET    (1 << 6)
+
+struct sched_attributes {
+	unsigned int       size;
+	unsigned int       sched_policy;
+	unsigned long long sched_flags;
+	int                sched_nice;
+	unsigned int       sched_priority;
+	unsigned long long sched_runtime;
+	unsigned long long sched_deadline;
+	unsigned long long sched_period;
+	unsigned int       sched_util_min;
+	unsigned int       sched_util_max;
+};
+
+static PyTypeObject SchedAttrType;
+
+static PyStructSequence_Field sched_attr_fields[] = {
+	{"policy",        "SCHED_* scheduling policy"},
+	{"priority",      "static priority for SCHED_FIFO and SCHED_RR"},
+	{"nice",          "nice value for SCHED_OTHER and SCHED_BATCH"},
+	{"runtime",       "SCHED_DEADLINE runtime in nanoseconds"},
+	{"deadline",      "SCHED_DEADLINE deadline in nanoseconds"},
+	{"period",        "SCHED_DEADLINE period in nanoseconds"},
+	{"util_min",      "minimum utilization clamp (0-1024)"},
+	{"util_max",      "maximum utilization clamp (0-1024)"},
+	{"reset_on_fork", "whether children revert to the default policy"},
+	{NULL}
+};
+
+static PyStructSequence_Desc sched_attr_desc = {
+	"prctl.SchedAttr",
+	"Scheduling attributes of a thread",
+	sched_attr_fields,
+	9,
+};
+
+static char sched_getattr_doc[] =
+"sched_getattr([thread]) -> SchedAttr\n\n\
+Return the scheduling attributes of thread, which is a TID or a\n\
+threading.Thread object and defaults to the calling thread.\n\
+";
+
+static char sched_setattr_doc[] =
+"sched_setattr([thread], policy=None, priority=None, nice=None,\n\
+              runtime=None, deadline=None, period=None, util_min=None,\n\
+              util_max=None, reset_on_fork=None) -> SchedAttr\n\n\
+Change the scheduling attributes of thread, leaving the ones which are\n\
+None untouched, and return the resulting attributes. policy is one of\n\
+the SCHED_* constants; runtime, deadline and period describe a\n\
+SCHED_DEADLINE reservation in nanoseconds; util_min and util_max set\n\
+the utilization clamps (0-1024).\n\
+";
+
+static char sched_scope_doc[] =
+"sched_scope([thread], **attributes) -> context manager\n\n\
+Apply the sched_setattr() attributes on entry, returning the resulting\n\
+SchedAttr, and restore the previous ones on exit.\n\
+";
+
+static int _sched_get(pid_t tid, struct sched_attributes *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+
+	if (syscall(SYS_sched_getattr, tid, attr, sizeof(*attr), 0) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _sched_set(pid_t tid, struct sched_attributes *attr)
+{
+	attr->size = sizeof(*attr);
+
+	if (syscall(SYS_sched_setattr, tid, attr, 0) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static PyObject *_sched_attr(struct sched_attributes *attr)
+{
+	PyObject *result;
+
+	result = PyStructSequence_New(&SchedAttrType);
+	if (!result)
+		return NULL;
+
+	PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(attr->sched_policy));
+	PyStructSequence_SET_ITEM(result, 1, PyInt_FromLong(attr->sched_priority));
+	PyStructSequence_SET_ITEM(result, 2, PyInt_FromLong(attr->sched_nice));
+	PyStructSequence_SET_ITEM(result, 3,
+		PyLong_FromUnsignedLongLong(attr->sched_runtime));
+	PyStructSequence_SET_ITEM(result, 4,
+		PyLong_FromUnsignedLongLong(attr->sched_deadline));
+	PyStructSequence_SET_ITEM(result, 5,
+		PyLong_FromUnsignedLongLong(attr->sched_period));
+	PyStructSequence_SET_ITEM(result, 6, PyInt_FromLong(attr->sched_util_min));
+	PyStructSequence_SET_ITEM(result, 7, PyInt_FromLong(attr->sched_util_max));
+	PyStructSequence_SET_ITEM(result, 8, PyBool_FromLong(
+		attr->sched_flags & SCHED_FLAG_RESET_ON_FORK));
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+/*
+ * Overlay the attributes given as keywords onto the current attributes
+ * of tid. Returns the set of SCHED_GIVEN_* bits or -1 on error.
+ */
+static int _sched_build(pid_t tid, PyObject *kw, struct sched_attributes *attr)
+{
+	static char *kwlist[] = {"policy", "priority", "nice", "runtime",
+				 "deadline", "period", "util_min", "util_max",
+				 "reset_on_fork", NULL};
+	PyObject *v[9] = {Py_None, Py_None, Py_None, Py_None, Py_None,
+			  Py_None, Py_None, Py_None, Py_None};
+	PyObject *empty;
+	int given = 0;
+	int rc;
+
+	empty = PyTuple_New(0);
+	if (!empty)
+		return -1;
+
+	rc = PyArg_ParseTupleAndKeywords(empty, kw, "|OOOOOOOOO", kwlist,
+					 &v[0], &v[1], &v[2], &v[3], &v[4],
+					 &v[5], &v[6], &v[7], &v[8]);
+	Py_DECREF(empty);
+	if (!rc)
+		return -1;
+
+	if (_sched_get(tid, attr) < 0)
+		return -1;
+
+	attr->sched_flags &= SCHED_FLAG_RESET_ON_FORK;
+
+	if (v[0] != Py_None) {
+		given |= SCHED_GIVEN_POLICY;
+		attr->sched_policy = PyInt_AsLong(v[0]);
+	}
+	if (v[1] != Py_None) {
+		given |= SCHED_GIVEN_PRIORITY;
+		attr->sched_priority = PyInt_AsLong(v[1]);
+	}
+	if (v[2] != Py_None) {
+		given |= SCHED_GIVEN_NICE;
+		attr->sched_nice = PyInt_AsLong(v[2]);
+	}
+	if (v[3] != Py_None || v[4] != Py_None || v[5] != Py_None) {
+		given |= SCHED_GIVEN_DL;
+		if (v[3] != Py_None)
+			attr->sched_runtime = PyInt_AsUnsignedLongLongMask(v[3]);
+		if (v[4] != Py_None)
+			attr->sched_deadline = PyInt_AsUnsignedLongLongMask(v[4]);
+		if (v[5] != Py_None)
+			attr->sched_period = PyInt_AsUnsignedLongLongMask(v[5]);
+	}
+	if (v[6] != Py_None) {
+		given |= SCHED_GIVEN_UTIL_MIN;
+		attr->sched_util_min = PyInt_AsLong(v[6]);
+		attr->sched_flags |= SCHED_FLAG_UTIL_CLAMP_MIN;
+	}
+	if (v[7] != Py_None) {
+		given |= SCHED_GIVEN_UTIL_MAX;
+		attr->sched_util_max = PyInt_AsLong(v[7]);
+		attr->sched_flags |= SCHED_FLAG_UTIL_CLAMP_MAX;
+	}
+	if (v[8] != Py_None) {
+		given |= SCHED_GIVEN_RESET;
+		attr->sched_flags &= ~SCHED_FLAG_RESET_ON_FORK;
+		if (PyObject_IsTrue(v[8]))
+			attr->sched_flags |= SCHED_FLAG_RESET_ON_FORK;
+	}
+
+	if (PyErr_Occurred())
+		return -1;
+
+	/* a clamp or reset_on_fork change alone keeps the policy as is */
+	if (!(given & (SCHED_GIVEN_POLICY | SCHED_GIVEN_PRIORITY |
+		       SCHED_GIVEN_NICE | SCHED_GIVEN_DL)))
+		attr->sched_flags |= SCHED_FLAG_KEEP_POLICY |
+			SCHED_FLAG_KEEP_PARAMS;
+
+	if (attr->sched_policy != SCHED_FIFO && attr->sched_policy != SCHED_RR)
+		attr->sched_priority = 0;
+
+	return given;
+}
+
+static PyObject *py_sched_getattr(PyObject *self, PyObject *args)
+{
+	struct sched_attributes attr;
+	PyObject *thread = NULL;
+	pid_t tid;
+
+	if (!PyArg_ParseTuple(args, "|O", &thread))
+		return NULL;
+
+	if (_resolve_tid(thread, &tid) < 0 || _sched_get(tid, &attr) < 0)
+		return NULL;
+
+	return _sched_attr(&attr);
+}
+
+static PyObject *py_sched_setattr(PyObject *self, PyObject *args, PyObject *kw)
+{
+	struct sched_attributes attr;
+	PyObject *thread = NULL;
+	pid_t tid;
+
+	if (!PyArg_ParseTuple(args, "|O", &thread))
+		return NULL;
+
+	if (_resolve_tid(thread, &tid) < 0)
+		return NULL;
+
+	if (_sched_build(tid, kw, &attr) < 0 || _sched_set(tid, &attr) < 0)
+		return NULL;
+
+	if (_sched_get(tid, &attr) < 0)
+		return NULL;
+
+	return _sched_attr(&attr);
+}
+
+static int _sched_scope_enter(ScopeObject *self)
+{
+	struct sched_attributes attr;
+	int given;
+
+	if (_sched_get(self->target, &attr) < 0)
+		return -1;
+	memcpy(self->state, &attr, sizeof(attr));
+
+	given = _sched_build(self->target, self->kw, &attr);
+	if (given < 0 || _sched_set(self->target, &attr) < 0)
+		return -1;
+	self->given = given;
+
+	if (_sched_get(self->target, &attr) < 0)
+		return -1;
+
+	self->value = _sched_attr(&attr);
+	return self->value ? 0 : -1;
+}
+
+static int _sched_scope_exit(ScopeObject *self)
+{
+	struct sched_attributes attr;
+
+	memcpy(&attr, self->state, sizeof(attr));
+
+	attr.sched_flags &= SCHED_FLAG_RESET_ON_FORK;
+	if (self->given & SCHED_GIVEN_UTIL_MIN)
+		attr.sched_flags |= SCHED_FLAG_UTIL_CLAMP_MIN;
+	if (self->given & SCHED_GIVEN_UTIL_MAX)
+		attr.sched_flags |= SCHED_FLAG_UTIL_CLAMP_MAX;
+
+	return _sched_set(self->target, &attr);
+}
+
+static struct scope_ops sched_scope_ops = {
+	_sched_scope_enter,
+	_sched_scope_exit,
+};
+
+static PyObject *py_sched_scope(PyObject *self, PyObject *args, PyObject *kw)
+{
+	PyObject *thread = NULL;
+	pid_t tid;
+
+	if (!PyArg_ParseTuple(args, "|O", &thread))
+		return NULL;
+
+	if (_resolve_tid(thread, &tid) < 0)
+		return NULL;
+
+	/* a scope entered from another thread must still hit this one */
+	if (!tid)
+		tid = syscall(SYS_gettid);
+
+	return _scope_new(&sched_scope_ops, tid, kw);
+}
+
+
+/*
+ * CPU topology and placement.
+ *
+ * The topology is read from sysfs once and kept in a flat table, one
+ * entry per online cpu, which is all the placement code needs.
+ */
+#define SYSFS_CPU  "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+
+struct cpu_info {
+	short cpu;
+	short package;
+	short core;
+	short node;
+	short llc;    /* lowest cpu sharing the last level cache */
+	short thread; /* index among the core's SMT siblings */
+};
+
+static struct {
+	int             loaded;
+	int             count;
+	struct cpu_info cpu[CPU_SETSIZE];
+} _topology;
+
+static PyTypeObject CpuInfoType;
+
+static PyStructSequence_Field cpu_info_fields[] = {
+	{"cpu",     "logical cpu number"},
+	{"package", "physical package (socket) id"},
+	{"core",    "core id within the package"},
+	{"node",    "NUMA node"},
+	{"llc",     "lowest cpu sharing this cpu's last level cache"},
+	{"thread",  "index among the core's SMT siblings, 0 for the first"},
+	{NULL}
+};
+
+static PyStructSequence_Desc cpu_info_desc = {
+	"prctl.CpuInfo",
+	"Topology of one logical cpu",
+	cpu_info_fields,
+	6,
+};
+
+static char cpu_topology_doc[] =
+"cpu_topology(refresh=False) -> [CpuInfo, ...]\n\n\
+Return the topology of every online cpu as read from sysfs. The table\n\
+is read once and cached unless refresh is set.\n\
+";
+
+static char place_worker_doc[] =
+"place_worker(index, count, smt=False) -> [cpu, ...]\n\n\
+Return the cpus for worker index out of count. Workers get one core\n\
+each, filling a last level cache before moving on to the next one and\n\
+leaving SMT siblings idle until every core is taken. Only cpus in the\n\
+current affinity mask are used. With smt set, the worker is given all\n\
+SMT siblings of its core instead of a single hardware thread.\n\
+";
+
+static char set_affinity_doc[] =
+"set_affinity(cpus, [target]) -> None\n\n\
+Restrict target, a pid, TID or threading.Thread and by default the\n\
+calling thread, to the given sequence of cpus.\n\
+";
+
+static char get_affinity_doc[] =
+"get_affinity([target]) -> [cpu, ...]\n\n\
+Return the cpus target is allowed to run on.\n\
+";
+
+static char pin_worker_doc[] =
+"pin_worker(index, count, [target], smt=False) -> [cpu, ...]\n\n\
+Set the affinity of target to place_worker(index, count, smt) and\n\
+return the cpus chosen.\n\
+";
+
+static int _read_sysfs(const char *path, char *buf, size_t len)
+{
+	ssize_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	size = read(fd, buf, len - 1);
+	close(fd);
+
+	if (size < 0)
+		return -1;
+
+	buf[size] = '\0';
+	return size;
+}
+
+static int _read_sysfs_int(const char *path, int fallback)
+{
+	char buf[32];
+
+	if (_read_sysfs(path, buf, sizeof(buf)) < 0)
+		return fallback;
+
+	return atoi(buf);
+}
+
+/*
+ * Parse a kernel cpu/node list such as "0-3,8,10-11".
+ */
+static void _parse_cpulist(const char *list, cpu_set_t *set)
+{
+	long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+
+	while (*list) {
+		first = strtol(list, &end, 10);
+		if (end == list)
+			break;
+
+		last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+
+		list = end;
+		if (*list == ',')
+			list++;
+		else
+			break;
+	}
+}
+
+static void _topology_load(void)
+{
+	struct cpu_info *info;
+	char path[128];
+	char buf[4096];
+	cpu_set_t online, nodes, set;
+	int level;
+	int node;
+	int cpu;
+	int i, j;
+
+	memset(&_topology, 0, sizeof(_topology));
+
+	if (_read_sysfs(SYSFS_CPU "/online", buf, sizeof(buf)) < 0)
+		snprintf(buf, sizeof(buf), "0-%ld",
+			 sysconf(_SC_NPROCESSORS_ONLN) - 1);
+	_parse_cpulist(buf, &online);
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &online))
+			continue;
+
+		info = &_topology.cpu[_topology.count++];
+		info->cpu = cpu;
+
+		snprintf(path, sizeof(path),
+			 SYSFS_CPU "/cpu%d/topology/physical_package_id", cpu);
+		info->package = _read_sysfs_int(path, 0);
+
+		snprintf(path, sizeof(path),
+			 SYSFS_CPU "/cpu%d/topology/core_id", cpu);
+		info->core = _read_sysfs_int(path, cpu);
+
+		/* the highest cache level shared by this cpu */
+		info->llc = cpu;
+		for (i = 0, level = 0; i < 8; i++) {
+			snprintf(path, sizeof(path),
+				 SYSFS_CPU "/cpu%d/cache/index%d/level", cpu, i);
+			j = _read_sysfs_int(path, -1);
+			if (j < 0)
+				break;
+			if (j < level)
+				continue;
+			level = j;
+
+			snprintf(path, sizeof(path), SYSFS_CPU
+				 "/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+			if (_read_sysfs(path, buf, sizeof(buf)) < 0)
+				continue;
+
+			_parse_cpulist(buf, &set);
+			for (j = 0; j < CPU_SETSIZE && !CPU_ISSET(j, &set); j++)
+				;
+			info->llc = j < CPU_SETSIZE ? j : cpu;
+		}
+	}
+
+	/* node numbers may have holes, without NUMA everything is node 0 */
+	if (_read_sysfs(SYSFS_NODE "/online", buf, sizeof(buf)) < 0)
+		snprintf(buf, sizeof(buf), "0");
+	_parse_cpulist(buf, &nodes);
+
+	for (node = 0; node < CPU_SETSIZE; node++) {
+		if (!CPU_ISSET(node, &nodes))
+			continue;
+
+		snprintf(path, sizeof(path), SYSFS_NODE "/node%d/cpulist", node);
+		if (_read_sysfs(path, buf, sizeof(buf)) < 0)
+			continue;
+
+		_parse_cpulist(buf, &set);
+		for (i = 0; i < _topology.count; i++)
+			if (CPU_ISSET(_topology.cpu[i].cpu, &set))
+				_topology.cpu[i].node = node;
+	}
+
+	for (i = 0; i < _topology.count; i++)
+		for (j = 0; j < i; j++)
+			if (_topology.cpu[j].package == _topology.cpu[i].package &&
+			    _topology.cpu[j].core == _topology.cpu[i].core)
+				_topology.cpu[i].thread++;
+
+	_topology.loaded = 1;
+}
+
+static struct cpu_info *_topology_get(void)
+{
+	if (!_topology.loaded)
+		_topology_load();
+
+	return _topology.cpu;
+}
+
+static int _placement_cmp(const void *a, const void *b)
+{
+	const struct cpu_info *x = a, *y = b;
+
+	if (x->thread != y->thread)
+		return x->thread - y->thread;
+	if (x->node != y->node)
+		return x->node - y->node;
+	if (x->llc != y->llc)
+		return x->llc - y->llc;
+	if (x->package != y->package)
+		return x->package - y->package;
+	if (x->core != y->core)
+		return x->core - y->core;
+
+	return x->cpu - y->cpu;
+}
+
+/*
+ * Order the usable cpus for placement: first hardware thread of every
+ * core grouped by node and last level cache, then second threads, etc.
+ */
+static int _placement_order(struct cpu_info *order)
+{
+	struct cpu_info *cpus = _topology_get();
+	cpu_set_t allowed;
+	int count = 0;
+	int i;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return -1;
+
+	for (i = 0; i < _topology.count; i++)
+		if (CPU_ISSET(cpus[i].cpu, &allowed))
+			order[count++] = cpus[i];
+
+	qsort(order, count, sizeof(*order), _placement_cmp);
+	return count;
+}
+
+static PyObject *_cpuset_to_list(cpu_set_t *set)
+{
+	PyObject *result, *item;
+	int cpu;
+
+	result = PyList_New(0);
+	if (!result)
+		return NULL;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, set))
+			continue;
+
+		item = PyInt_FromLong(cpu);
+		if (!item || PyList_Append(result, item) < 0) {
+			Py_XDECREF(item);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+
+	return result;
+}
+
+static int _place_worker(int index, int count, int smt, cpu_set_t *set)
+{
+	static struct cpu_info order[CPU_SETSIZE];
+	static struct cpu_info *cores[CPU_SETSIZE];
+	struct cpu_info *chosen;
+	int total, ncores;
+	int i, j;
+
+	if (count <= 0 || index < 0 || index >= count) {
+		PyErr_SetString(PyExc_ValueError, "invalid worker index or count");
+		return -1;
+	}
+
+	total = _placement_order(order);
+	if (total < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+	if (!total) {
+		PyErr_SetString(ErrorObject, "no usable cpus");
+		return -1;
+	}
+
+	CPU_ZERO(set);
+
+	if (smt) {
+		/*
+		 * One whole core per worker. thread numbers the siblings
+		 * of the whole system, so the allowed set may hold no
+		 * thread 0 at all; count its distinct cores instead.
+		 */
+		for (i = 0, ncores = 0; i < total; i++) {
+			for (j = 0; j < ncores; j++)
+				if (cores[j]->package == order[i].package &&
+				    cores[j]->core == order[i].core)
+					break;
+			if (j == ncores)
+				cores[ncores++] = &order[i];
+		}
+		if (!ncores) {
+			PyErr_SetString(PyExc_ValueError, "no usable cores");
+			return -1;
+		}
+		chosen = cores[index % ncores];
+
+		for (i = 0; i < total; i++)
+			if (order[i].package == chosen->package &&
+			    order[i].core == chosen->core)
+				CPU_SET(order[i].cpu, set);
+		return 0;
+	}
+
+	CPU_SET(order[index % total].cpu, set);
+	return 0;
+}
+
+static int _set_affinity(pid_t target, cpu_set_t *set)
+{
+	if (sched_setaffinity(target, sizeof(*set), set) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static PyObject *py_cpu_topology(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"refresh", NULL};
+	PyObject *result, *item;
+	struct cpu_info *cpus;
+	int refresh = 0;
+	int i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|i", kwlist, &refresh))
+		return NULL;
+
+	if (refresh)
+		_topology.loaded = 0;
+
+	cpus = _topology_get();
+
+	result = PyList_New(_topology.count);
+	if (!result)
+		return NULL;
+
+	for (i = 0; i < _topology.count; i++) {
+		item = PyStructSequence_New(&CpuInfoType);
+		if (!item) {
+			Py_DECREF(result);
+			return NULL;
+		}
+
+		PyStructSequence_SET_ITEM(item, 0, PyInt_FromLong(cpus[i].cpu));
+		PyStructSequence_SET_ITEM(item, 1, PyInt_FromLong(cpus[i].package));
+		PyStructSequence_SET_ITEM(item, 2, PyInt_FromLong(cpus[i].core));
+		PyStructSequence_SET_ITEM(item, 3, PyInt_FromLong(cpus[i].node));
+		PyStructSequence_SET_ITEM(item, 4, PyInt_FromLong(cpus[i].llc));
+		PyStructSequence_SET_ITEM(item, 5, PyInt_FromLong(cpus[i].thread));
+		PyList_SET_ITEM(result, i, item);
+	}
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+static PyObject *py_place_worker(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"index", "count", "smt", NULL};
+	cpu_set_t set;
+	int index, count;
+	int smt = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ii|i", kwlist,
+					 &index, &count, &smt))
+		return NULL;
+
+	if (_place_worker(index, count, smt, &set) < 0)
+		return NULL;
+
+	return _cpuset_to_list(&set);
+}
+
+static PyObject *py_pin_worker(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"index", "count", "target", "smt", NULL};
+	PyObject *target = NULL;
+	cpu_set_t set;
+	int index, count;
+	int smt = 0;
+	pid_t tid;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ii|Oi", kwlist,
+					 &index, &count, &target, &smt))
+		return NULL;
+
+	if (_resolve_tid(target, &tid) < 0)
+		return NULL;
+
+	if (_place_worker(index, count, smt, &set) < 0)
+		return NULL;
+
+	if (_set_affinity(tid, &set) < 0)
+		return NULL;
+
+	return _cpuset_to_list(&set);
+}
+
+static PyObject *py_set_affinity(PyObject *self, PyObject *args)
+{
+	PyObject *cpus;
+	PyObject *target = NULL;
+	cpu_set_t set;
+	pid_t tid;
+
+	if (!PyArg_ParseTuple(args, "O|O", &cpus, &target))
+		return NULL;
+
+	if (_resolve_tid(target, &tid) < 0 || _cpuset_from_seq(cpus, &set) < 0)
+		return NULL;
+
+	if (_set_affinity(tid, &set) < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *py_get_affinity(PyObject *self, PyObject *args)
+{
+	PyObject *target = NULL;
+	cpu_set_t set;
+	pid_t tid;
+
+	if (!PyArg_ParseTuple(args, "|O", &target))
+		return NULL;
+
+	if (_resolve_tid(target, &tid) < 0)
+		return NULL;
+
+	if (sched_getaffinity(tid, sizeof(set), &set) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	return _cpuset_to_list(&set);
+}
+
+
+/*
+ * Memory ranges of buffer objects.
+ *
+ * Calls which advise or bind memory take any object exporting a buffer
+ * and act on the pages it spans, rounded out to page boundaries, so
+ * they also affect whatever else shares the first and last page.
+ */
+static int _buffer_pages(PyObject *obj, unsigned long *start, size_t *len)
+{
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned long begin, end;
+	const void *data;
+	Py_ssize_t size;
+	Py_buffer view;
+
+	if (PyObject_CheckBuffer(obj)) {
+		if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0)
+			return -1;
+		data = view.buf;
+		size = view.len;
+		PyBuffer_Release(&view);
+	} else if (PyObject_AsReadBuffer(obj, &data, &size) < 0)
+		return -1;
+
+	begin = (unsigned long)data & ~(page - 1);
+	end = ((unsigned long)data + size + page - 1) & ~(page - 1);
+
+	*start = begin;
+	*len   = end - begin;
+	return 0;
+}
+
+/*
+ * NUMA memory policy through the raw syscalls, so that there is no
+ * dependency on libnuma.
+ */
+#define MPOL_DEFAULT             0
+#define MPOL_PREFERRED           1
+#define MPOL_BIND                2
+#define MPOL_INTERLEAVE          3
+#define MPOL_LOCAL               4
+#define MPOL_PREFERRED_MANY      5
+#define MPOL_WEIGHTED_INTERLEAVE 6
+
+#define MPOL_F_NUMA_BALANCING    (1 << 13)
+#define MPOL_F_RELATIVE_NODES    (1 << 14)
+#define MPOL_F_STATIC_NODES      (1 << 15)
+
+#define MPOL_MF_STRICT           (1 << 0)
+#define MPOL_MF_MOVE             (1 << 1)
+#define MPOL_MF_MOVE_ALL         (1 << 2)
+
+#define NODEMASK_BITS 1024
+#define NODEMASK_LONG (8 * sizeof(unsigned long))
+
+struct nodemask {
+	unsigned long bits[NODEMASK_BITS / NODEMASK_LONG];
+};
+
+static char set_mempolicy_doc[] =
+"set_mempolicy(mode, nodes=(), flags=0) -> None\n\n\
+Set the NUMA memory policy of the calling thread. mode is one of the\n\
+MPOL_* policies, flags may add MPOL_F_STATIC_NODES or\n\
+MPOL_F_RELATIVE_NODES.\n\
+";
+
+static char get_mempolicy_doc[] =
+"get_mempolicy() -> (mode, nodes)\n\n\
+Return the NUMA memory policy of the calling thread.\n\
+";
+
+static char mbind_doc[] =
+"mbind(buffer, mode, nodes=(), flags=0) -> None\n\n\
+Set the NUMA memory policy for the pages spanned by buffer. flags may\n\
+be MPOL_MF_STRICT and MPOL_MF_MOVE to migrate pages already present.\n\
+";
+
+static char page_nodes_doc[] =
+"page_nodes(buffer) -> [node, ...]\n\n\
+Return the NUMA node each page spanned by buffer currently lives on,\n\
+or None for pages which are not present.\n\
+";
+
+static int _nodemask_from_seq(PyObject *seq, struct nodemask *mask)
+{
+	PyObject *fast;
+	Py_ssize_t i;
+	long node;
+
+	memset(mask, 0, sizeof(*mask));
+
+	if (!seq)
+		return 0;
+
+	fast = PySequence_Fast(seq, "nodes must be a sequence");
+	if (!fast)
+		return -1;
+
+	for (i = 0; i < PySequence_Fast_GET_SIZE(fast); i++) {
+		node = PyInt_AsLong(PySequence_Fast_GET_ITEM(fast, i));
+		if (node == -1 && PyErr_Occurred())
+			goto error;
+
+		if (node < 0 || node >= NODEMASK_BITS) {
+			PyErr_SetString(PyExc_ValueError, "invalid node number");
+			goto error;
+		}
+
+		mask->bits[node / NODEMASK_LONG] |= 1UL << (node % NODEMASK_LONG);
+	}
+
+	Py_DECREF(fast);
+	return 0;
+error:
+	Py_DECREF(fast);
+	return -1;
+}
+
+static PyObject *_nodemask_to_list(struct nodemask *mask)
+{
+	PyObject *result, *item;
+	int node;
+
+	result = PyList_New(0);
+	if (!result)
+		return NULL;
+
+	for (node = 0; node < NODEMASK_BITS; node++) {
+		if (!(mask->bits[node / NODEMASK_LONG] &
+		      (1UL << (node % NODEMASK_LONG))))
+			continue;
+
+		item = PyInt_FromLong(node);
+		if (!item || PyList_Append(result, item) < 0) {
+			Py_XDECREF(item);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+
+	return result;
+}
+
+static int _mbind(unsigned long start, size_t len, int mode,
+		  struct nodemask *mask, unsigned int flags)
+{
+	/* the kernel ignores the last bit of maxnode */
+	if (syscall(SYS_mbind, start, len, mode, mask->bits,
+		    NODEMASK_BITS + 1, flags) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static PyObject *py_set_mempolicy(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"mode", "nodes", "flags", NULL};
+	struct nodemask mask;
+	PyObject *nodes = NULL;
+	int flags = 0;
+	int mode;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "i|Oi", kwlist,
+					 &mode, &nodes, &flags))
+		return NULL;
+
+	if (_nodemask_from_seq(nodes, &mask) < 0)
+		return NULL;
+
+	if (syscall(SYS_set_mempolicy, mode | flags, mask.bits,
+		    NODEMASK_BITS + 1) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *py_get_mempolicy(PyObject *self)
+{
+	struct nodemask mask;
+	PyObject *nodes;
+	int mode = 0;
+
+	memset(&mask, 0, sizeof(mask));
+
+	if (syscall(SYS_get_mempolicy, &mode, mask.bits, NODEMASK_BITS,
+		    NULL, 0) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	nodes = _nodemask_to_list(&mask);
+	if (!nodes)
+		return NULL;
+
+	return Py_BuildValue("(iN)", mode, nodes);
+}
+
+static PyObject *py_mbind(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"buffer", "mode", "nodes", "flags", NULL};
+	struct nodemask mask;
+	PyObject *buffer;
+	PyObject *nodes = NULL;
+	unsigned long start;
+	size_t len;
+	int flags = 0;
+	int mode;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "Oi|Oi", kwlist,
+					 &buffer, &mode, &nodes, &flags))
+		return NULL;
+
+	if (_nodemask_from_seq(nodes, &mask) < 0)
+		return NULL;
+
+	if (_buffer_pages(buffer, &start, &len) < 0)
+		return NULL;
+
+	if (_mbind(start, len, mode, &mask, flags) < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *py_page_nodes(PyObject *self, PyObject *args)
+{
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	PyObject *buffer, *result = NULL;
+	unsigned long start;
+	void **pages = NULL;
+	int *status = NULL;
+	size_t count, i;
+	size_t len;
+
+	if (!PyArg_ParseTuple(args, "O", &buffer))
+		return NULL;
+
+	if (_buffer_pages(buffer, &start, &len) < 0)
+		return NULL;
+
+	count = len / page;
+
+	pages  = PyMem_New(void *, count ? count : 1);
+	status = PyMem_New(int, count ? count : 1);
+	if (!pages || !status) {
+		PyErr_NoMemory();
+		goto done;
+	}
+
+	for (i = 0; i < count; i++)
+		pages[i] = (void *)(start + i * page);
+
+	/* with no target nodes move_pages only reports where pages are */
+	if (syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		goto done;
+	}
+
+	result = PyList_New(count);
+	if (!result)
+		goto done;
+
+	for (i = 0; i < count; i++) {
+		if (status[i] < 0) {
+			Py_INCREF(Py_None);
+			PyList_SET_ITEM(result, i, Py_None);
+		} else
+			PyList_SET_ITEM(result, i, PyInt_FromLong(status[i]));
+	}
+done:
+	PyMem_Free(pages);
+	PyMem_Free(status);
+	return result;
+}
+
+
+/*
+ * Buffers backed by their own anonymous mapping.
+ *
+ * alloc_buffer() hands out memoryviews over a MappedBuffer, which owns
+ * a 2 MiB aligned mapping and unmaps it once the last view is gone.
+ */
+#ifndef PR_SET_VMA
+#define PR_SET_VMA           0x53564d41
+#define PR_SET_VMA_ANON_NAME 0
+#endif
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+typedef struct {
+	PyObject_HEAD
+	char   *addr;
+	size_t  size;     /* as requested */
+	size_t  length;   /* of the mapping */
+} MappedBufferObject;
+
+static PyTypeObject MappedBufferType;
+
+static char alloc_buffer_doc[] =
+"alloc_buffer(size, hugepages=None, name=None, lock=False, node=None)\n\
+    -> memoryview\n\n\
+Return a writable memoryview over a fresh, 2 MiB aligned anonymous\n\
+mapping of size bytes. hugepages may be \"thp\" to advise the mapping\n\
+with MADV_HUGEPAGE or \"hugetlb\" to back it with preallocated huge\n\
+pages. name labels the mapping in /proc/pid/maps through\n\
+PR_SET_VMA_ANON_NAME where the kernel supports it, node binds it to a\n\
+NUMA node and lock mlocks it. The mapping is released with the last\n\
+reference to it.\n\
+";
+
+/*
+ * Labels are informational, so kernels built without CONFIG_ANON_VMA_NAME
+ * (which answer EINVAL) leave the mapping unnamed rather than failing.
+ */
+static int _name_mapping(void *addr, size_t length, const char *name)
+{
+	if (prctl(PR_SET_VMA, PR_SET_VMA_ANON_NAME, (unsigned long)addr,
+		  length, (unsigned long)name) < 0 && errno != EINVAL) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Map length bytes aligned to a huge page boundary by over-allocating
+ * and trimming the excess on either side.
+ */
+static void *_map_aligned(size_t length, int hugetlb)
+{
+	unsigned long start, aligned;
+	char *addr;
+
+	if (hugetlb)
+		return mmap(NULL, length, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	addr = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return addr;
+
+	start   = (unsigned long)addr;
+	aligned = (start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+	if (aligned > start)
+		munmap(addr, aligned - start);
+	if (start + HUGE_PAGE_SIZE > aligned)
+		munmap((char *)aligned + length,
+		       start + HUGE_PAGE_SIZE - aligned);
+
+	return (void *)aligned;
+}
+
+static void MappedBuffer_dealloc(MappedBufferObject *self)
+{
+	if (self->addr)
+		munmap(self->addr, self->length);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int MappedBuffer_getbuffer(MappedBufferObject *self, Py_buffer *view,
+				  int flags)
+{
+	return PyBuffer_FillInfo(view, (PyObject *)self, self->addr,
+				 self->size, 0, flags);
+}
+
+static Py_ssize_t MappedBuffer_getreadbuf(MappedBufferObject *self,
+					  Py_ssize_t segment, void **ptr)
+{
+	if (segment) {
+		PyErr_SetString(PyExc_SystemError, "invalid buffer segment");
+		return -1;
+	}
+
+	*ptr = self->addr;
+	return self->size;
+}
+
+static Py_ssize_t MappedBuffer_getsegcount(MappedBufferObject *self,
+					   Py_ssize_t *lenp)
+{
+	if (lenp)
+		*lenp = self->size;
+	return 1;
+}
+
+static Py_ssize_t MappedBuffer_length(MappedBufferObject *self)
+{
+	return self->size;
+}
+
+static PySequenceMethods MappedBuffer_as_sequence = {
+	(lenfunc)MappedBuffer_length,
+};
+
+static PyBufferProcs MappedBuffer_as_buffer = {
+	(readbufferproc)MappedBuffer_getreadbuf,
+	(writebufferproc)MappedBuffer_getreadbuf,
+	(segcountproc)MappedBuffer_getsegcount,
+	0,
+	(getbufferproc)MappedBuffer_getbuffer,
+	0,
+};
+
+static PyTypeObject MappedBufferType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"prctl.MappedBuffer",
+	sizeof(MappedBufferObject),
+	0,
+	(destructor)MappedBuffer_dealloc,	/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	&MappedBuffer_as_sequence,		/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	&MappedBuffer_as_buffer,		/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+	"Anonymous mapping owned by alloc_buffer()", /* tp_doc */
+};
+
+static PyObject *py_alloc_buffer(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"size", "hugepages", "name", "lock", "node",
+				 NULL};
+	MappedBufferObject *buffer;
+	struct nodemask mask;
+	PyObject *result, *nodes;
+	PyObject *node = Py_None;
+	char *hugepages = NULL;
+	char *name = NULL;
+	Py_ssize_t size;
+	size_t length;
+	int hugetlb = 0;
+	int thp = 0;
+	int lock = 0;
+	int rc;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "n|zziO", kwlist, &size,
+					 &hugepages, &name, &lock, &node))
+		return NULL;
+
+	if (size <= 0) {
+		PyErr_SetString(PyExc_ValueError, "size must be positive");
+		return NULL;
+	}
+
+	if (hugepages && !strcmp(hugepages, "thp"))
+		thp = 1;
+	else if (hugepages && !strcmp(hugepages, "hugetlb"))
+		hugetlb = 1;
+	else if (hugepages) {
+		PyErr_SetString(PyExc_ValueError,
+				"hugepages must be \"thp\", \"hugetlb\" or None");
+		return NULL;
+	}
+
+	length = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+	buffer = PyObject_New(MappedBufferObject, &MappedBufferType);
+	if (!buffer)
+		return NULL;
+
+	buffer->size   = size;
+	buffer->length = length;
+	buffer->addr   = _map_aligned(length, hugetlb);
+
+	if (buffer->addr == MAP_FAILED) {
+		buffer->addr = NULL;
+		PyErr_SetFromErrno(ErrorObject);
+		goto error;
+	}
+
+	if (thp && madvise(buffer->addr, length, MADV_HUGEPAGE) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		goto error;
+	}
+
+	if (name && _name_mapping(buffer->addr, length, name) < 0)
+		goto error;
+
+	if (node != Py_None) {
+		nodes = PyTuple_Pack(1, node);
+		if (!nodes)
+			goto error;
+		rc = _nodemask_from_seq(nodes, &mask);
+		Py_DECREF(nodes);
+		if (rc < 0)
+			goto error;
+		if (_mbind((unsigned long)buffer->addr, length, MPOL_BIND,
+			   &mask, 0) < 0)
+			goto error;
+	}
+
+	if (lock && mlock(buffer->addr, length) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		goto error;
+	}
+
+	result = PyMemoryView_FromObject((PyObject *)buffer);
+	Py_DECREF(buffer);
+	return result;
+error:
+	Py_DECREF(buffer);
+	return NULL;
+}
+
+
+/*
+ * /proc/pid/maps parsing.
+ */
+struct vma {
+	unsigned long start;
+	unsigned long end;
+	unsigned long offset;
+	unsigned long inode;
+	char          perms[8];
+	char          path[PATH_MAX];
+};
+
+static FILE *_maps_open(pid_t pid)
+{
+	char path[64];
+
+	if (pid)
+		snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	else
+		snprintf(path, sizeof(path), "/proc/self/maps");
+
+	return fopen(path, "re");
+}
+
+static int _maps_next(FILE *maps, struct vma *vma)
+{
+	char line[PATH_MAX + 128];
+	int pos = 0;
+
+	if (!fgets(line, sizeof(line), maps))
+		return 0;
+
+	vma->path[0] = '\0';
+
+	if (sscanf(line, "%lx-%lx %7s %lx %*s %lu %n", &vma->start, &vma->end,
+		   vma->perms, &vma->offset, &vma->inode, &pos) < 5)
+		return 0;
+
+	if (pos) {
+		strncpy(vma->path, line + pos, sizeof(vma->path) - 1);
+		vma->path[sizeof(vma->path) - 1] = '\0';
+		vma->path[strcspn(vma->path, "\n")] = '\0';
+	}
+
+	return 1;
+}
+
+/*
+ * Python 2 has no arena allocator hook, obmalloc maps its arenas with
+ * plain mmap and they merge into larger anonymous regions. Those can
+ * still be advised for transparent huge pages and labelled after the
+ * fact, which is what hugepage_heap() does.
+ */
+#define HEAP_NAME "python-heap"
+
+/*
+ * Whether vma is part of the heap: a private, writable anonymous mapping
+ * of at least min_size bytes which is not a thread stack, and unnamed or
+ * labelled name already. Mappings named otherwise, such as buffers from
+ * alloc_buffer(), belong to someone else. Consecutive mappings must be
+ * passed in order with the same guard.
+ */
+static int _heap_vma(struct vma *vma, unsigned long *guard, size_t min_size,
+		     const char *name)
+{
+	size_t len;
+
+	/* thread stacks sit right above a PROT_NONE guard page */
+	if (!strcmp(vma->perms, "---p") && !vma->inode) {
+		*guard = vma->end;
+		return 0;
+	}
+	if (vma->start == *guard)
+		return 0;
+
+	if (strcmp(vma->perms, "rw-p") || vma->inode ||
+	    vma->end - vma->start < min_size)
+		return 0;
+	if (!vma->path[0] || !strcmp(vma->path, "[heap]"))
+		return 1;
+
+	if (!name || strncmp(vma->path, "[anon:", 6))
+		return 0;
+
+	len = strlen(name);
+	return !strncmp(vma->path + 6, name, len) &&
+		!strcmp(vma->path + 6 + len, "]");
+}
+
+static char hugepage_heap_doc[] =
+"hugepage_heap(name=\"python-heap\", min_size=2097152) -> [(start, end), ...]\n\n\
+Advise every private, writable anonymous mapping of at least min_size\n\
+bytes, which is where obmalloc arenas and the malloc heap live, with\n\
+MADV_HUGEPAGE and label it with name where the kernel supports it.\n\
+Thread stacks and mappings labelled with another name, such as\n\
+alloc_buffer() buffers, are skipped. Mappings created later are not\n\
+affected, so call it after warm-up, and again when the heap has grown.\n\
+Returns the ranges advised.\n\
+";
+
+static PyObject *py_hugepage_heap(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"name", "min_size", NULL};
+	unsigned long guard = 0;
+	PyObject *result, *item;
+	Py_ssize_t min_size = HUGE_PAGE_SIZE;
+	char *name = HEAP_NAME;
+	struct vma vma;
+	FILE *maps;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|zn", kwlist,
+					 &name, &min_size))
+		return NULL;
+
+	maps = _maps_open(0);
+	if (!maps)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	result = PyList_New(0);
+	if (!result)
+		goto done;
+
+	while (_maps_next(maps, &vma)) {
+		if (!_heap_vma(&vma, &guard, min_size, name))
+			continue;
+
+		if (madvise((void *)vma.start, vma.end - vma.start,
+			    MADV_HUGEPAGE) < 0) {
+			PyErr_SetFromErrno(ErrorObject);
+			Py_CLEAR(result);
+			goto done;
+		}
+
+		if (name && strcmp(vma.path, "[heap]") &&
+		    _name_mapping((void *)vma.start, vma.end - vma.start,
+				  name) < 0) {
+			Py_CLEAR(result);
+			goto done;
+		}
+
+		item = Py_BuildValue("(kk)", vma.start, vma.end);
+		if (!item || PyList_Append(result, item) < 0) {
+			Py_XDECREF(item);
+			Py_CLEAR(result);
+			goto done;
+		}
+		Py_DECREF(item);
+	}
+done:
+	fclose(maps);
+	return result;
+}
+
+
+/*
+ * Executable text on huge pages.
+ *
+ * The 2 MiB aligned part of a text mapping is copied into an anonymous
+ * mapping advised for THP, made executable and moved over the original
+ * in one mremap(), so the range is never missing or half written and a
+ * failure leaves the original text in place.
+ */
+#define THP_ENABLED "/sys/kernel/mm/transparent_hugepage/enabled"
+
+static char hugify_text_doc[] =
+"hugify_text(modules=None, force=False) -> [(path, start, end, remapped)]\n\n\
+Move the executable text of libpython, or of the interpreter binary if\n\
+it is linked statically, onto transparent huge pages. modules may list\n\
+further paths, path fragments or module objects whose shared objects\n\
+should be treated the same. Only whole, aligned 2 MiB ranges can be\n\
+moved; remapped is the number of bytes moved for each text mapping\n\
+considered. Nothing is done when THP is disabled. As other threads\n\
+could be executing the code being moved the call refuses to run in a\n\
+threaded process unless force is set. Profilers which symbolize from\n\
+file backed mappings will no longer see the moved range.\n\
+";
+
+static int _thp_available(void)
+{
+	char buf[128];
+
+	if (_read_sysfs(THP_ENABLED, buf, sizeof(buf)) < 0)
+		return 0;
+
+	return !strstr(buf, "[never]");
+}
+
+static int _thread_count(void)
+{
+	char line[256];
+	int count = -1;
+	FILE *status;
+
+	status = fopen("/proc/self/status", "re");
+	if (!status)
+		return -1;
+
+	while (fgets(line, sizeof(line), status))
+		if (sscanf(line, "Threads: %d", &count) == 1)
+			break;
+
+	fclose(status);
+	return count;
+}
+
+/*
+ * Build a huge page backed copy of the text in a mapping of its own and
+ * move it over the original with one mremap(), which either replaces
+ * the range as a whole or fails before touching it. Nothing can fail
+ * once the text is gone.
+ */
+static int _remap_text(unsigned long start, unsigned long length)
+{
+	unsigned long area, copy;
+	int error;
+
+	/* place the copy huge page aligned so its huge pages move intact */
+	area = (unsigned long)mmap(NULL, length + HUGE_PAGE_SIZE,
+				   PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((void *)area == MAP_FAILED)
+		return errno;
+
+	copy = (area + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	if (copy > area)
+		munmap((void *)area, copy - area);
+	if (area + HUGE_PAGE_SIZE > copy)
+		munmap((void *)(copy + length), area + HUGE_PAGE_SIZE - copy);
+
+	if (madvise((void *)copy, length, MADV_HUGEPAGE) < 0)
+		goto error;
+
+	memcpy((void *)copy, (void *)start, length);
+
+	if (mprotect((void *)copy, length, PROT_READ | PROT_EXEC) < 0)
+		goto error;
+
+	if (mremap((void *)copy, length, length, MREMAP_MAYMOVE | MREMAP_FIXED,
+		   (void *)start) == MAP_FAILED)
+		goto error;
+
+	return 0;
+error:
+	error = errno;
+	munmap((void *)copy, length);
+	return error;
+}
+
+static int _text_selected(struct vma *vma, const char *exe, PyObject *modules)
+{
+	const char *base = strrchr(vma->path, '/');
+	PyObject *item, *file;
+	Py_ssize_t i;
+	int match;
+
+	base = base ? base + 1 : vma->path;
+
+	if (!strncmp(base, "libpython", 9) || !strcmp(vma->path, exe))
+		return 1;
+
+	if (!modules)
+		return 0;
+
+	for (i = 0; i < PySequence_Fast_GET_SIZE(modules); i++) {
+		item = PySequence_Fast_GET_ITEM(modules, i);
+
+		if (PyString_Check(item)) {
+			if (strstr(vma->path, PyString_AS_STRING(item)))
+				return 1;
+			continue;
+		}
+
+		file = PyObject_GetAttrString(item, "__file__");
+		if (!file) {
+			PyErr_Clear();
+			continue;
+		}
+
+		match = PyString_Check(file) &&
+			!strcmp(vma->path, PyString_AS_STRING(file));
+		Py_DECREF(file);
+
+		if (match)
+			return 1;
+	}
+
+	return 0;
+}
+
+static PyObject *py_hugify_text(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"modules", "force", NULL};
+	unsigned long here = (unsigned long)py_hugify_text;
+	unsigned long libc = (unsigned long)memcpy;
+	unsigned long start, end;
+	PyObject *modules = Py_None;
+	PyObject *result = NULL, *item;
+	char exe[PATH_MAX];
+	struct vma vma;
+	ssize_t size;
+	FILE *maps;
+	int force = 0;
+	int error;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|Oi", kwlist,
+					 &modules, &force))
+		return NULL;
+
+	if (!force && _thread_count() != 1) {
+		PyErr_SetString(ErrorObject,
+				"hugify_text() needs a single threaded process");
+		return NULL;
+	}
+
+	if (!_thp_available())
+		return PyList_New(0);
+
+	size = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	exe[size < 0 ? 0 : size] = '\0';
+
+	if (modules == Py_None)
+		modules = NULL;
+	else {
+		modules = PySequence_Fast(modules, "modules must be a sequence");
+		if (!modules)
+			return NULL;
+	}
+
+	maps = _maps_open(0);
+	if (!maps) {
+		PyErr_SetFromErrno(ErrorObject);
+		goto done;
+	}
+
+	result = PyList_New(0);
+	if (!result)
+		goto done;
+
+	while (_maps_next(maps, &vma)) {
+		if (strcmp(vma.perms, "r-xp") || !vma.inode)
+			continue;
+
+		/* never pull the rug from under ourselves or libc */
+		if ((here >= vma.start && here < vma.end) ||
+		    (libc >= vma.start && libc < vma.end))
+			continue;
+
+		if (!_text_selected(&vma, exe, modules))
+			continue;
+
+		start = (vma.start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		end   = vma.end & ~(HUGE_PAGE_SIZE - 1);
+
+		if (end > start) {
+			error = _remap_text(start, end - start);
+			if (error) {
+				errno = error;
+				PyErr_SetFromErrno(ErrorObject);
+				Py_CLEAR(result);
+				goto done;
+			}
+		} else
+			end = start;
+
+		item = Py_BuildValue("(skkk)", vma.path, vma.start, vma.end,
+				     end - start);
+		if (!item || PyList_Append(result, item) < 0) {
+			Py_XDECREF(item);
+			Py_CLEAR(result);
+			goto done;
+		}
+		Py_DECREF(item);
+	}
+done:
+	if (maps)
+		fclose(maps);
+	Py_XDECREF(modules);
+	return result;
+}
+
+
+/*
+ * Memory locking and pre-faulting.
+ */
+#ifndef MCL_ONFAULT
+#define MCL_ONFAULT 4
+#endif
+
+#define STACK_MARGIN (64 << 10)
+
+static PyTypeObject MemLockType;
+
+static PyStructSequence_Field mem_lock_fields[] = {
+	{"locked",     "bytes locked into memory (VmLck)"},
+	{"pinned",     "bytes pinned into memory (VmPin)"},
+	{"limit",      "soft RLIMIT_MEMLOCK in bytes, None if unlimited"},
+	{"hard_limit", "hard RLIMIT_MEMLOCK in bytes, None if unlimited"},
+	{NULL}
+};
+
+static PyStructSequence_Desc mem_lock_desc = {
+	"prctl.MemLock",
+	"Locked memory of the process and its limits",
+	mem_lock_fields,
+	4,
+};
+
+static char mlockall_doc[] =
+"mlockall(flags) -> None\n\n\
+Lock the address space of the process into memory. flags combines\n\
+MCL_CURRENT, MCL_FUTURE and MCL_ONFAULT.\n\
+";
+
+static char munlockall_doc[] =
+"munlockall() -> None\n\n\
+Unlock the whole address space of the process.\n\
+";
+
+static char mlock_scope_doc[] =
+"mlock_scope(flags=MCL_CURRENT | MCL_FUTURE) -> context manager\n\n\
+Call mlockall(flags) on entry and munlockall() on exit, unless some\n\
+memory was already locked on entry, in which case the locks are left\n\
+in place.\n\
+";
+
+static char prefault_doc[] =
+"prefault(stack=65536, heap=True, buffers=()) -> int\n\n\
+Fault in and lock stack bytes below the current stack pointer, the heap\n\
+as selected by hugepage_heap() when heap is set and the pages spanned\n\
+by each of buffers. Returns the total size of the ranges locked, which\n\
+counts overlapping ranges more than once.\n\
+";
+
+static char locked_memory_doc[] =
+"locked_memory() -> MemLock\n\n\
+Return the locked and pinned memory of the process along with the\n\
+RLIMIT_MEMLOCK limits.\n\
+";
+
+static char page_faults_doc[] =
+"page_faults(thread=False) -> (minflt, majflt)\n\n\
+Return the minor and major page faults of the process, or of the\n\
+calling thread only when thread is set.\n\
+";
+
+static long _status_kb(const char *field)
+{
+	size_t len = strlen(field);
+	char line[256];
+	long value = -1;
+	FILE *status;
+
+	status = fopen("/proc/self/status", "re");
+	if (!status)
+		return -1;
+
+	while (fgets(line, sizeof(line), status))
+		if (!strncmp(line, field, len) && line[len] == ':') {
+			value = strtol(line + len + 1, NULL, 10);
+			break;
+		}
+
+	fclose(status);
+	return value;
+}
+
+static PyObject *_rlimit_value(rlim_t value)
+{
+	if (value == RLIM_INFINITY) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	return PyLong_FromUnsignedLongLong(value);
+}
+
+static __attribute__((noinline)) int _prefault_stack(size_t size)
+{
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	volatile char *stack;
+	pthread_attr_t attr;
+	unsigned long low;
+	void *base;
+	size_t limit;
+	size_t i;
+
+	if (pthread_getattr_np(pthread_self(), &attr))
+		return EINVAL;
+	pthread_attr_getstack(&attr, &base, &limit);
+	pthread_attr_destroy(&attr);
+
+	low = (unsigned long)&low;
+	if (low - (unsigned long)base < size + STACK_MARGIN)
+		return ENOMEM;
+
+	stack = alloca(size);
+	for (i = 0; i < size; i += page)
+		stack[i] = 0;
+
+	low = (unsigned long)stack & ~(page - 1);
+	return mlock((void *)low, (unsigned long)&i - low) < 0 ? errno : 0;
+}
+
+static PyObject *py_mlockall(PyObject *self, PyObject *args)
+{
+	int flags;
+
+	if (!PyArg_ParseTuple(args, "i", &flags))
+		return NULL;
+
+	if (mlockall(flags) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *py_munlockall(PyObject *self)
+{
+	if (munlockall() < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static int _mlock_scope_enter(ScopeObject *self)
+{
+	self->state[0] = _status_kb("VmLck");
+
+	if (mlockall(self->state[1]) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _mlock_scope_exit(ScopeObject *self)
+{
+	if (self->state[0] > 0)
+		return 0;
+
+	if (munlockall() < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct scope_ops mlock_scope_ops = {
+	_mlock_scope_enter,
+	_mlock_scope_exit,
+};
+
+static PyObject *py_mlock_scope(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"flags", NULL};
+	ScopeObject *scope;
+	int flags = MCL_CURRENT | MCL_FUTURE;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|i", kwlist, &flags))
+		return NULL;
+
+	scope = (ScopeObject *)_scope_new(&mlock_scope_ops, 0, NULL);
+	if (scope)
+		scope->state[1] = flags;
+
+	return (PyObject *)scope;
+}
+
+static PyObject *py_prefault(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"stack", "heap", "buffers", NULL};
+	unsigned long guard = 0;
+	unsigned long start;
+	unsigned long long total = 0;
+	PyObject *buffers = NULL, *fast;
+	Py_ssize_t stack = 65536;
+	struct vma vma;
+	Py_ssize_t i;
+	size_t len;
+	FILE *maps;
+	int heap = 1;
+	int error;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|niO", kwlist,
+					 &stack, &heap, &buffers))
+		return NULL;
+
+	if (stack > 0) {
+		error = _prefault_stack(stack);
+		if (error) {
+			errno = error;
+			return PyErr_SetFromErrno(ErrorObject);
+		}
+		total += stack;
+	}
+
+	if (heap) {
+		maps = _maps_open(0);
+		if (!maps)
+			return PyErr_SetFromErrno(ErrorObject);
+
+		while (_maps_next(maps, &vma)) {
+			if (!_heap_vma(&vma, &guard, 0, HEAP_NAME))
+				continue;
+
+			if (mlock((void *)vma.start, vma.end - vma.start) < 0) {
+				PyErr_SetFromErrno(ErrorObject);
+				fclose(maps);
+				return NULL;
+			}
+			total += vma.end - vma.start;
+		}
+
+		fclose(maps);
+	}
+
+	if (buffers) {
+		fast = PySequence_Fast(buffers, "buffers must be a sequence");
+		if (!fast)
+			return NULL;
+
+		for (i = 0; i < PySequence_Fast_GET_SIZE(fast); i++) {
+			if (_buffer_pages(PySequence_Fast_GET_ITEM(fast, i),
+					  &start, &len) < 0) {
+				Py_DECREF(fast);
+				return NULL;
+			}
+
+			if (mlock((void *)start, len) < 0) {
+				PyErr_SetFromErrno(ErrorObject);
+				Py_DECREF(fast);
+				return NULL;
+			}
+			total += len;
+		}
+
+		Py_DECREF(fast);
+	}
+
+	return PyLong_FromUnsignedLongLong(total);
+}
+
+static PyObject *py_locked_memory(PyObject *self)
+{
+	struct rlimit limit;
+	PyObject *result;
+	long locked, pinned;
+
+	if (getrlimit(RLIMIT_MEMLOCK, &limit) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	locked = _status_kb("VmLck");
+	pinned = _status_kb("VmPin");
+
+	result = PyStructSequence_New(&MemLockType);
+	if (!result)
+		return NULL;
+
+	PyStructSequence_SET_ITEM(result, 0,
+		PyLong_FromLongLong(locked < 0 ? 0 : (long long)locked << 10));
+	PyStructSequence_SET_ITEM(result, 1,
+		PyLong_FromLongLong(pinned < 0 ? 0 : (long long)pinned << 10));
+	PyStructSequence_SET_ITEM(result, 2, _rlimit_value(limit.rlim_cur));
+	PyStructSequence_SET_ITEM(result, 3, _rlimit_value(limit.rlim_max));
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+static PyObject *py_page_faults(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"thread", NULL};
+	struct rusage ru;
+	int thread = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|i", kwlist, &thread))
+		return NULL;
+
+	if (getrusage(thread ? RUSAGE_THREAD : RUSAGE_SELF, &ru) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	return Py_BuildValue("(ll)", ru.ru_minflt, ru.ru_majflt);
+}
+
+
+/*
+ * Memory advice for this process and, through pidfds, for others.
+ */
+#ifndef SYS_process_madvise
+#define SYS_process_madvise 440
+#endif
+
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+#define MADVISE_BATCH 512
+
+static char pidfd_open_doc[] =
+"pidfd_open(pid) -> pidfd\n\n\
+Return a close-on-exec pidfd referring to process pid.\n\
+";
+
+static char madvise_doc[] =
+"madvise(buffer, advice) -> None\n\n\
+Give the MADV_* advice for the pages spanned by buffer.\n\
+";
+
+static char process_madvise_doc[] =
+"process_madvise(pidfd, advice, ranges=None) -> int\n\n\
+Give the MADV_* advice, typically MADV_COLD or MADV_PAGEOUT, for memory\n\
+of the process referred to by pidfd. ranges is a sequence of (start,\n\
+length) pairs and defaults to every private anonymous mapping listed\n\
+in its /proc/pid/maps. Returns the number of bytes advised.\n\
+";
+
+/*
+ * Return the pid behind pidfd in our namespace, or -1 with errno set:
+ * fdinfo shows -1 once the process exited and 0 when it lives in a pid
+ * namespace we cannot see.
+ */
+static pid_t _pidfd_pid(int pidfd)
+{
+	char path[64];
+	char line[128];
+	int found = 0;
+	pid_t pid = 0;
+	FILE *info;
+
+	snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", pidfd);
+
+	info = fopen(path, "re");
+	if (!info)
+		return -1;
+
+	while (fgets(line, sizeof(line), info))
+		if (sscanf(line, "Pid: %d", &pid) == 1) {
+			found = 1;
+			break;
+		}
+
+	fclose(info);
+
+	if (!found) {
+		errno = EBADF;
+		return -1;
+	}
+	if (pid <= 0) {
+		errno = ESRCH;
+		return -1;
+	}
+
+	return pid;
+}
+
+static int _private_anon_vma(struct vma *vma)
+{
+	if (vma->perms[3] != 'p' || vma->inode)
+		return 0;
+
+	return !vma->path[0] || !strcmp(vma->path, "[heap]") ||
+		!strcmp(vma->path, "[stack]") ||
+		!strncmp(vma->path, "[anon:", 6);
+}
+
+/*
+ * Advise a batch of ranges. The kernel stops at the first range it
+ * cannot advise and returns the bytes advised before it, or the error
+ * when it was the first. Leniently, a range which went away or cannot
+ * be advised since it was listed is skipped and the rest still done.
+ */
+static long long _process_madvise(int pidfd, struct iovec *iov, int count,
+				  int advice, int lenient)
+{
+	long long total = 0;
+	long rc;
+	int i = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	while (i < count) {
+		rc = syscall(SYS_process_madvise, pidfd, &iov[i], count - i,
+			     advice, 0);
+		if (rc < 0) {
+			if (!lenient || (errno != ENOMEM && errno != EINVAL)) {
+				total = -1;
+				break;
+			}
+			i++;
+			continue;
+		}
+
+		total += rc;
+		for (; i < count && (size_t)rc >= iov[i].iov_len; i++)
+			rc -= iov[i].iov_len;
+
+		/* strictly, the next round fails on it and returns the error */
+		if (i < count && lenient)
+			i++;
+	}
+	Py_END_ALLOW_THREADS
+
+	return total;
+}
+
+static PyObject *py_pidfd_open(PyObject *self, PyObject *args)
+{
+	int pidfd;
+	int pid;
+
+	if (!PyArg_ParseTuple(args, "i", &pid))
+		return NULL;
+
+	pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	return PyInt_FromLong(pidfd);
+}
+
+static PyObject *py_madvise(PyObject *self, PyObject *args)
+{
+	PyObject *buffer;
+	unsigned long start;
+	size_t len;
+	int advice;
+
+	if (!PyArg_ParseTuple(args, "Oi", &buffer, &advice))
+		return NULL;
+
+	if (_buffer_pages(buffer, &start, &len) < 0)
+		return NULL;
+
+	if (madvise((void *)start, len, advice) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *py_process_madvise(PyObject *self, PyObject *args,
+				    PyObject *kw)
+{
+	static char *kwlist[] = {"pidfd", "advice", "ranges", NULL};
+	struct iovec iov[MADVISE_BATCH];
+	PyObject *ranges = Py_None, *fast;
+	unsigned long long start, length;
+	long long total = 0;
+	long long rc;
+	struct vma vma;
+	Py_ssize_t i;
+	FILE *maps;
+	int count = 0;
+	int more;
+	int advice;
+	int pidfd;
+	pid_t pid;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "ii|O", kwlist,
+					 &pidfd, &advice, &ranges))
+		return NULL;
+
+	if (ranges != Py_None) {
+		fast = PySequence_Fast(ranges, "ranges must be a sequence");
+		if (!fast)
+			return NULL;
+
+		for (i = 0; i < PySequence_Fast_GET_SIZE(fast); i++) {
+			if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(fast, i),
+					      "KK", &start, &length)) {
+				Py_DECREF(fast);
+				return NULL;
+			}
+
+			iov[count].iov_base = (void *)(unsigned long)start;
+			iov[count].iov_len  = length;
+
+			if (++count < MADVISE_BATCH &&
+			    i + 1 < PySequence_Fast_GET_SIZE(fast))
+				continue;
+
+			rc = _process_madvise(pidfd, iov, count, advice, 0);
+			if (rc < 0) {
+				Py_DECREF(fast);
+				return PyErr_SetFromErrno(ErrorObject);
+			}
+			total += rc;
+			count = 0;
+		}
+
+		Py_DECREF(fast);
+		return PyLong_FromLongLong(total);
+	}
+
+	pid = _pidfd_pid(pidfd);
+	if (pid < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	maps = _maps_open(pid);
+	if (!maps)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	for (;;) {
+		more = _maps_next(maps, &vma);
+		if (more && !_private_anon_vma(&vma))
+			continue;
+
+		if (more) {
+			iov[count].iov_base = (void *)vma.start;
+			iov[count].iov_len  = vma.end - vma.start;
+			if (++count < MADVISE_BATCH)
+				continue;
+		}
+
+		if (count) {
+			rc = _process_madvise(pidfd, iov, count, advice, 1);
+			if (rc < 0) {
+				PyErr_SetFromErrno(ErrorObject);
+				fclose(maps);
+				return NULL;
+			}
+			total += rc;
+			count = 0;
+		}
+
+		if (!more)
+			break;
+	}
+
+	fclose(maps);
+	return PyLong_FromLongLong(total);
+}
+
+
+/*
+ * Core dump size control.
+ */
+#ifndef MADV_DONTDUMP
+#define MADV_DONTDUMP 16
+#define MADV_DODUMP   17
+#endif
+
+#define COREDUMP_ANON_PRIVATE    (1 << 0)
+#define COREDUMP_ANON_SHARED     (1 << 1)
+#define COREDUMP_FILE_PRIVATE    (1 << 2)
+#define COREDUMP_FILE_SHARED     (1 << 3)
+#define COREDUMP_ELF_HEADERS     (1 << 4)
+#define COREDUMP_HUGETLB_PRIVATE (1 << 5)
+#define COREDUMP_HUGETLB_SHARED  (1 << 6)
+#define COREDUMP_DAX_PRIVATE     (1 << 7)
+#define COREDUMP_DAX_SHARED      (1 << 8)
+
+struct vma_usage {
+	unsigned long long size;
+	unsigned long long rss;
+	unsigned long long anonymous;
+	char               flags[256];
+};
+
+static PyTypeObject CoreSizeType;
+
+static PyStructSequence_Field core_size_fields[] = {
+	{"size",     "bytes of memory the core file would cover"},
+	{"resident", "resident bytes among them, roughly the disk usage"},
+	{"mappings", "number of mappings dumped"},
+	{NULL}
+};
+
+static PyStructSequence_Desc core_size_desc = {
+	"prctl.CoreSize",
+	"Estimated size of a core dump",
+	core_size_fields,
+	3,
+};
+
+static char get_coredump_filter_doc[] =
+"get_coredump_filter(pid=0) -> bits\n\n\
+Return the COREDUMP_* bits of /proc/pid/coredump_filter.\n\
+";
+
+static char set_coredump_filter_doc[] =
+"set_coredump_filter(bits, pid=0) -> None\n\n\
+Select which kinds of mappings are written to core dumps.\n\
+";
+
+static char dont_dump_doc[] =
+"dont_dump(buffer) -> None\n\n\
+Exclude the pages spanned by buffer from core dumps (MADV_DONTDUMP).\n\
+";
+
+static char do_dump_doc[] =
+"do_dump(buffer) -> None\n\n\
+Undo dont_dump() for the pages spanned by buffer (MADV_DODUMP).\n\
+";
+
+static char core_size_doc[] =
+"core_size(pid=0) -> CoreSize\n\n\
+Estimate the size of a core dump of the process from its smaps and\n\
+coredump_filter, following the kernel's rules for which mappings are\n\
+written.\n\
+";
+
+static int _smaps_next(FILE *smaps, struct vma *vma, struct vma_usage *usage)
+{
+	char line[512];
+
+	if (!_maps_next(smaps, vma))
+		return 0;
+
+	memset(usage, 0, sizeof(*usage));
+
+	while (fgets(line, sizeof(line), smaps)) {
+		if (sscanf(line, "Size: %llu", &usage->size) == 1)
+			usage->size <<= 10;
+		else if (sscanf(line, "Rss: %llu", &usage->rss) == 1)
+			usage->rss <<= 10;
+		else if (sscanf(line, "Anonymous: %llu", &usage->anonymous) == 1)
+			usage->anonymous <<= 10;
+		else if (!strncmp(line, "VmFlags:", 8)) {
+			/* always the last line of an entry */
+			snprintf(usage->flags, sizeof(usage->flags), "%.*s",
+				 (int)sizeof(usage->flags) - 1, line + 8);
+			break;
+		}
+	}
+
+	return 1;
+}
+
+static int _vma_flag(struct vma_usage *usage, const char *flag)
+{
+	const char *p = usage->flags;
+
+	while ((p = strstr(p, flag))) {
+		if (p > usage->flags && p[-1] == ' ' &&
+		    (p[2] == ' ' || p[2] == '\n' || !p[2]))
+			return 1;
+		p += 2;
+	}
+
+	return 0;
+}
+
+/*
+ * Mirrors vma_dump_size() in fs/coredump.c. Returns 1 for the whole
+ * mapping, 0 for none of it and -1 for just the ELF header page.
+ */
+static int _vma_dumped(struct vma *vma, struct vma_usage *usage,
+		       unsigned long filter)
+{
+	int shared = _vma_flag(usage, "sh");
+	int anon;
+
+	if (_vma_flag(usage, "dd") || _vma_flag(usage, "io") ||
+	    _vma_flag(usage, "pf"))
+		return 0;
+
+	if (_vma_flag(usage, "ht"))
+		return !!(filter & (shared ? COREDUMP_HUGETLB_SHARED :
+				    COREDUMP_HUGETLB_PRIVATE));
+
+	if (shared) {
+		anon = !vma->inode || strstr(vma->path, "(deleted)") ||
+			!strncmp(vma->path, "/SYSV", 5);
+		return !!(filter & (anon ? COREDUMP_ANON_SHARED :
+				    COREDUMP_FILE_SHARED));
+	}
+
+	if ((!vma->inode || usage->anonymous) &&
+	    filter & COREDUMP_ANON_PRIVATE)
+		return 1;
+
+	if (!vma->inode)
+		return 0;
+
+	if (filter & COREDUMP_FILE_PRIVATE)
+		return 1;
+
+	if (filter & COREDUMP_ELF_HEADERS && !vma->offset &&
+	    vma->perms[0] == 'r')
+		return -1;
+
+	return 0;
+}
+
+static int _coredump_filter_path(char *path, size_t len, pid_t pid)
+{
+	if (pid)
+		return snprintf(path, len, "/proc/%d/coredump_filter", pid);
+
+	return snprintf(path, len, "/proc/self/coredump_filter");
+}
+
+static long _get_coredump_filter(pid_t pid)
+{
+	char path[64];
+	char buf[32];
+
+	_coredump_filter_path(path, sizeof(path), pid);
+
+	if (_read_sysfs(path, buf, sizeof(buf)) < 0)
+		return -1;
+
+	return strtol(buf, NULL, 16);
+}
+
+static PyObject *py_get_coredump_filter(PyObject *self, PyObject *args)
+{
+	long filter;
+	int pid = 0;
+
+	if (!PyArg_ParseTuple(args, "|i", &pid))
+		return NULL;
+
+	filter = _get_coredump_filter(pid);
+	if (filter < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	return PyInt_FromLong(filter);
+}
+
+static PyObject *py_set_coredump_filter(PyObject *self, PyObject *args)
+{
+	unsigned long bits;
+	char path[64];
+	char buf[32];
+	int pid = 0;
+	int len;
+	int fd;
+
+	if (!PyArg_ParseTuple(args, "k|i", &bits, &pid))
+		return NULL;
+
+	_coredump_filter_path(path, sizeof(path), pid);
+	len = snprintf(buf, sizeof(buf), "0x%lx\n", bits);
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	if (write(fd, buf, len) != len) {
+		PyErr_SetFromErrno(ErrorObject);
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *_madvise_buffer(PyObject *args, int advice)
+{
+	PyObject *buffer;
+	unsigned long start;
+	size_t len;
+
+	if (!PyArg_ParseTuple(args, "O", &buffer))
+		return NULL;
+
+	if (_buffer_pages(buffer, &start, &len) < 0)
+		return NULL;
+
+	if (madvise((void *)start, len, advice) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *py_dont_dump(PyObject *self, PyObject *args)
+{
+	return _madvise_buffer(args, MADV_DONTDUMP);
+}
+
+static PyObject *py_do_dump(PyObject *self, PyObject *args)
+{
+	return _madvise_buffer(args, MADV_DODUMP);
+}
+
+static PyObject *py_core_size(PyObject *self, PyObject *args)
+{
+	unsigned long long size = 0, resident = 0;
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	struct vma_usage usage;
+	PyObject *result;
+	struct vma vma;
+	char path[64];
+	long filter;
+	long count = 0;
+	FILE *smaps;
+	int dumped;
+	int pid = 0;
+
+	if (!PyArg_ParseTuple(args, "|i", &pid))
+		return NULL;
+
+	filter = _get_coredump_filter(pid);
+	if (filter < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	if (pid)
+		snprintf(path, sizeof(path), "/proc/%d/smaps", pid);
+	else
+		snprintf(path, sizeof(path), "/proc/self/smaps");
+
+	smaps = fopen(path, "re");
+	if (!smaps)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	while (_smaps_next(smaps, &vma, &usage)) {
+		dumped = _vma_dumped(&vma, &usage, filter);
+		if (!dumped)
+			continue;
+
+		count++;
+
+		if (dumped < 0) {
+			size += page;
+			resident += page;
+			continue;
+		}
+
+		size += usage.size;
+		resident += usage.rss;
+	}
+
+	fclose(smaps);
+
+	result = PyStructSequence_New(&CoreSizeType);
+	if (!result)
+		return NULL;
+
+	PyStructSequence_SET_ITEM(result, 0, PyLong_FromUnsignedLongLong(size));
+	PyStructSequence_SET_ITEM(result, 1,
+		PyLong_FromUnsignedLongLong(resident));
+	PyStructSequence_SET_ITEM(result, 2, PyInt_FromLong(count));
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+
+/*
+ * glibc heap tuning.
+ */
+#define TRIMMER_STATE_STOPPED 0
+#define TRIMMER_STATE_RUNNING 1
+#define TRIMMER_STATE_STOPPING 2
+
+static PyTypeObject MallocArenaType;
+
+static PyStructSequence_Field malloc_arena_fields[] = {
+	{"arena",           "arena number, None for the process totals"},
+	{"fast_count",      "free chunks in fastbins"},
+	{"fast_bytes",      "bytes free in fastbins"},
+	{"rest_count",      "other free chunks"},
+	{"rest_bytes",      "bytes free in other chunks"},
+	{"mmap_count",      "chunks allocated with mmap, totals only"},
+	{"mmap_bytes",      "bytes allocated with mmap, totals only"},
+	{"system_current",  "bytes currently obtained from the system"},
+	{"system_max",      "most bytes ever obtained from the system"},
+	{"aspace_total",    "address space reserved"},
+	{"aspace_mprotect", "address space made accessible"},
+	{NULL}
+};
+
+static PyStructSequence_Desc malloc_arena_desc = {
+	"prctl.MallocArena",
+	"Statistics of one glibc malloc arena",
+	malloc_arena_fields,
+	11,
+};
+
+struct malloc_arena {
+	int                arena;
+	unsigned long long fast_count, fast_bytes;
+	unsigned long long rest_count, rest_bytes;
+	unsigned long long mmap_count, mmap_bytes;
+	unsigned long long system_current, system_max;
+	unsigned long long aspace_total, aspace_mprotect;
+};
+
+static struct {
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  wake;
+	int             state;
+	double          idle;
+	double          interval;
+	double          threshold;
+	size_t          pad;
+	unsigned long   trims;
+	unsigned long   released;
+} _trimmer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+static char mallopt_doc[] =
+"mallopt(param, value) -> None\n\n\
+Set a glibc malloc parameter such as M_ARENA_MAX, M_TRIM_THRESHOLD,\n\
+M_MMAP_THRESHOLD or M_TOP_PAD.\n\
+";
+
+static char malloc_trim_doc[] =
+"malloc_trim(pad=0) -> bool\n\n\
+Return free memory at the top of the heap and free pages inside every\n\
+arena to the system, keeping pad bytes. Returns whether any memory was\n\
+released.\n\
+";
+
+static char malloc_info_doc[] =
+"malloc_info() -> ([MallocArena, ...], MallocArena)\n\n\
+Return the statistics of every glibc malloc arena and the totals for\n\
+the process, as reported by malloc_info(3).\n\
+";
+
+static char start_trimmer_doc[] =
+"start_trimmer(idle=30.0, interval=1.0, threshold=0.01, pad=0) -> None\n\n\
+Start a background thread which calls malloc_trim(pad) once the\n\
+process has been idle, using less than threshold of a cpu, for idle\n\
+seconds. Activity is sampled every interval seconds and the trimmer\n\
+waits for the process to become busy again before trimming anew.\n\
+";
+
+static char stop_trimmer_doc[] =
+"stop_trimmer() -> (trims, released)\n\n\
+Stop the background trimmer and return how many times it trimmed and\n\
+how many of those released memory.\n\
+";
+
+static PyObject *py_mallopt(PyObject *self, PyObject *args)
+{
+	int param, value;
+
+	if (!PyArg_ParseTuple(args, "ii", &param, &value))
+		return NULL;
+
+	if (!mallopt(param, value)) {
+		errno = EINVAL;
+		return PyErr_SetFromErrno(ErrorObject);
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *py_malloc_trim(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"pad", NULL};
+	Py_ssize_t pad = 0;
+	int released;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|n", kwlist, &pad))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	released = malloc_trim(pad);
+	Py_END_ALLOW_THREADS
+
+	return PyBool_FromLong(released);
+}
+
+static PyObject *_malloc_arena(struct malloc_arena *arena)
+{
+	PyObject *result;
+
+	result = PyStructSequence_New(&MallocArenaType);
+	if (!result)
+		return NULL;
+
+	if (arena->arena < 0) {
+		Py_INCREF(Py_None);
+		PyStructSequence_SET_ITEM(result, 0, Py_None);
+	} else
+		PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(arena->arena));
+
+#define SET(i, field) \
+	PyStructSequence_SET_ITEM(result, i, \
+		PyLong_FromUnsignedLongLong(arena->field))
+	SET(1, fast_count);
+	SET(2, fast_bytes);
+	SET(3, rest_count);
+	SET(4, rest_bytes);
+	SET(5, mmap_count);
+	SET(6, mmap_bytes);
+	SET(7, system_current);
+	SET(8, system_max);
+	SET(9, aspace_total);
+	SET(10, aspace_mprotect);
+#undef SET
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+static void _malloc_info_line(const char *line, struct malloc_arena *arena)
+{
+	unsigned long long count, size;
+	char type[16];
+
+	if (sscanf(line, " <total type=\"%15[^\"]\" count=\"%llu\" size=\"%llu\"",
+		   type, &count, &size) == 3) {
+		if (!strcmp(type, "fast")) {
+			arena->fast_count = count;
+			arena->fast_bytes = size;
+		} else if (!strcmp(type, "rest")) {
+			arena->rest_count = count;
+			arena->rest_bytes = size;
+		} else if (!strcmp(type, "mmap")) {
+			arena->mmap_count = count;
+			arena->mmap_bytes = size;
+		}
+	} else if (sscanf(line, " <system type=\"%15[^\"]\" size=\"%llu\"",
+			  type, &size) == 2) {
+		if (!strcmp(type, "current"))
+			arena->system_current = size;
+		else if (!strcmp(type, "max"))
+			arena->system_max = size;
+	} else if (sscanf(line, " <aspace type=\"%15[^\"]\" size=\"%llu\"",
+			  type, &size) == 2) {
+		if (!strcmp(type, "total"))
+			arena->aspace_total = size;
+		else if (!strcmp(type, "mprotect"))
+			arena->aspace_mprotect = size;
+	}
+}
+
+static PyObject *py_malloc_info(PyObject *self)
+{
+	struct malloc_arena arena, total;
+	PyObject *arenas, *item;
+	char *buf = NULL;
+	char *line, *next;
+	size_t size = 0;
+	FILE *out;
+	int nr;
+
+	out = open_memstream(&buf, &size);
+	if (!out)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	if (malloc_info(0, out) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		fclose(out);
+		free(buf);
+		return NULL;
+	}
+	fclose(out);
+
+	arenas = PyList_New(0);
+	if (!arenas)
+		goto error;
+
+	memset(&total, 0, sizeof(total));
+	memset(&arena, 0, sizeof(arena));
+	total.arena = -1;
+	arena.arena = -1;
+
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		if (sscanf(line, " <heap nr=\"%d\"", &nr) == 1) {
+			memset(&arena, 0, sizeof(arena));
+			arena.arena = nr;
+		} else if (strstr(line, "</heap>")) {
+			item = _malloc_arena(&arena);
+			if (!item || PyList_Append(arenas, item) < 0) {
+				Py_XDECREF(item);
+				goto error;
+			}
+			Py_DECREF(item);
+			arena.arena = -1;
+		} else if (strstr(line, "<sizes>") || strstr(line, "<size ") ||
+			   strstr(line, "<unsorted "))
+			continue;
+		else
+			_malloc_info_line(line, arena.arena < 0 ? &total : &arena);
+	}
+
+	item = _malloc_arena(&total);
+	if (!item)
+		goto error;
+
+	free(buf);
+	return Py_BuildValue("(NN)", arenas, item);
+error:
+	Py_XDECREF(arenas);
+	free(buf);
+	return NULL;
+}
+
+static double _cpu_seconds(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *_trimmer_main(void *arg)
+{
+	double wall, cpu, last_wall, last_cpu;
+	double idle_since;
+	struct timespec deadline;
+	int trimmed = 0;
+
+	last_wall  = _cpu_seconds(CLOCK_MONOTONIC);
+	last_cpu   = _cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+	idle_since = last_wall;
+
+	pthread_mutex_lock(&_trimmer.lock);
+
+	while (_trimmer.state == TRIMMER_STATE_RUNNING) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec  += (time_t)_trimmer.interval;
+		deadline.tv_nsec += (long)((_trimmer.interval -
+					    (time_t)_trimmer.interval) * 1e9);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&_trimmer.wake, &_trimmer.lock,
+				       &deadline);
+		if (_trimmer.state != TRIMMER_STATE_RUNNING)
+			break;
+
+		wall = _cpu_seconds(CLOCK_MONOTONIC);
+		cpu  = _cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+
+		if (cpu - last_cpu > (wall - last_wall) * _trimmer.threshold) {
+			idle_since = wall;
+			trimmed = 0;
+		} else if (!trimmed && wall - idle_since >= _trimmer.idle) {
+			pthread_mutex_unlock(&_trimmer.lock);
+			trimmed = 1;
+			if (malloc_trim(_trimmer.pad))
+				_trimmer.released++;
+			_trimmer.trims++;
+			pthread_mutex_lock(&_trimmer.lock);
+			/* our own work should not count as activity */
+			cpu = _cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+		}
+
+		last_wall = wall;
+		last_cpu  = cpu;
+	}
+
+	pthread_mutex_unlock(&_trimmer.lock);
+	return NULL;
+}
+
+/* Wait on CLOCK_MONOTONIC so that clock steps do not stretch or skip a trim. */
+static void _trimmer_cond_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&_trimmer.wake, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void _trimmer_atfork_child(void)
+{
+	/* the thread does not survive fork */
+	pthread_mutex_init(&_trimmer.lock, NULL);
+	_trimmer_cond_init();
+	_trimmer.state = TRIMMER_STATE_STOPPED;
+}
+
+static PyObject *py_start_trimmer(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"idle", "interval", "threshold", "pad", NULL};
+	static int atfork;
+	double idle = 30.0, interval = 1.0, threshold = 0.01;
+	Py_ssize_t pad = 0;
+	int error;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|dddn", kwlist, &idle,
+					 &interval, &threshold, &pad))
+		return NULL;
+
+	if (interval <= 0 || idle < 0 || threshold < 0) {
+		PyErr_SetString(PyExc_ValueError, "invalid trimmer parameters");
+		return NULL;
+	}
+
+	/* no trimmer thread can be waiting on the cond before this */
+	if (!atfork) {
+		_trimmer_cond_init();
+		pthread_atfork(NULL, NULL, _trimmer_atfork_child);
+		atfork = 1;
+	}
+
+	if (_trimmer.state != TRIMMER_STATE_STOPPED) {
+		PyErr_SetString(ErrorObject, "trimmer already running");
+		return NULL;
+	}
+
+	_trimmer.idle      = idle;
+	_trimmer.interval  = interval;
+	_trimmer.threshold = threshold;
+	_trimmer.pad       = pad;
+	_trimmer.trims     = 0;
+	_trimmer.released  = 0;
+	_trimmer.state     = TRIMMER_STATE_RUNNING;
+
+	error = pthread_create(&_trimmer.thread, NULL, _trimmer_main, NULL);
+	if (error) {
+		_trimmer.state = TRIMMER_STATE_STOPPED;
+		errno = error;
+		return PyErr_SetFromErrno(ErrorObject);
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *py_stop_trimmer(PyObject *self)
+{
+	if (_trimmer.state != TRIMMER_STATE_RUNNING) {
+		PyErr_SetString(ErrorObject, "trimmer not running");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&_trimmer.lock);
+	_trimmer.state = TRIMMER_STATE_STOPPING;
+	pthread_cond_signal(&_trimmer.wake);
+	pthread_mutex_unlock(&_trimmer.lock);
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_join(_trimmer.thread, NULL);
+	Py_END_ALLOW_THREADS
+
+	_trimmer.state = TRIMMER_STATE_STOPPED;
+
+	return Py_BuildValue("(kk)", _trimmer.trims, _trimmer.released);
+}
+
+
+/*
+ * /proc readers.
+ *
+ * The files are read into one static buffer, protected by the GIL, and
+ * decoded in place without going through Python strings, which keeps a
+ * scrape of many processes cheap.
+ */
+#define PROC_BUF_SIZE 16384
+
+static char _proc_buf[PROC_BUF_SIZE];
+
+struct proc_field {
+	const char *name;
+	int         kb;
+};
+
+static PyTypeObject ProcStatType;
+static PyTypeObject ProcStatusType;
+static PyTypeObject SmapsRollupType;
+
+static PyStructSequence_Field proc_stat_fields[] = {
+	{"pid",         "process id"},
+	{"comm",        "command name"},
+	{"state",       "scheduling state (R, S, D, Z, ...)"},
+	{"ppid",        "parent process id"},
+	{"minflt",      "minor page faults"},
+	{"majflt",      "major page faults"},
+	{"utime",       "user time in seconds"},
+	{"stime",       "system time in seconds"},
+	{"priority",    "kernel scheduling priority"},
+	{"nice",        "nice value"},
+	{"num_threads", "number of threads"},
+	{"starttime",   "start time in seconds after boot"},
+	{"vsize",       "virtual memory size in bytes"},
+	{"rss",         "resident set size in bytes"},
+	{"processor",   "cpu last run on"},
+	{"blkio_delay", "seconds spent waiting for block I/O"},
+	{NULL}
+};
+
+static PyStructSequence_Desc proc_stat_desc = {
+	"prctl.ProcStat",
+	"Decoded /proc/pid/stat",
+	proc_stat_fields,
+	16,
+};
+
+static const struct proc_field proc_status_table[] = {
+	{"VmPeak", 1},
+	{"VmSize", 1},
+	{"VmHWM", 1},
+	{"VmRSS", 1},
+	{"RssAnon", 1},
+	{"RssFile", 1},
+	{"RssShmem", 1},
+	{"VmSwap", 1},
+	{"Threads", 0},
+	{"voluntary_ctxt_switches", 0},
+	{"nonvoluntary_ctxt_switches", 0},
+};
+
+static PyStructSequence_Field proc_status_fields[] = {
+	{"vm_peak",  "peak virtual memory size in bytes"},
+	{"vm_size",  "virtual memory size in bytes"},
+	{"vm_hwm",   "peak resident set size in bytes"},
+	{"vm_rss",   "resident set size in bytes"},
+	{"rss_anon", "resident anonymous memory in bytes"},
+	{"rss_file", "resident file mappings in bytes"},
+	{"rss_shmem", "resident shared memory in bytes"},
+	{"vm_swap",  "swapped out anonymous memory in bytes"},
+	{"threads",  "number of threads"},
+	{"voluntary_ctxt_switches",    "voluntary context switches"},
+	{"nonvoluntary_ctxt_switches", "involuntary context switches"},
+	{NULL}
+};
+
+static PyStructSequence_Desc proc_status_desc = {
+	"prctl.ProcStatus",
+	"Decoded /proc/pid/status",
+	proc_status_fields,
+	11,
+};
+
+static const struct proc_field smaps_rollup_table[] = {
+	{"Rss", 1},
+	{"Pss", 1},
+	{"Pss_Anon", 1},
+	{"Pss_File", 1},
+	{"Pss_Shmem", 1},
+	{"Shared_Clean", 1},
+	{"Shared_Dirty", 1},
+	{"Private_Clean", 1},
+	{"Private_Dirty", 1},
+	{"Anonymous", 1},
+	{"AnonHugePages", 1},
+	{"Swap", 1},
+	{"SwapPss", 1},
+	{"Locked", 1},
+};
+
+static PyStructSequence_Field smaps_rollup_fields[] = {
+	{"rss",             "resident set size"},
+	{"pss",             "proportional set size"},
+	{"pss_anon",        "proportional anonymous memory"},
+	{"pss_file",        "proportional file backed memory"},
+	{"pss_shmem",       "proportional shared memory"},
+	{"shared_clean",    "clean pages shared with other processes"},
+	{"shared_dirty",    "dirty pages shared with other processes"},
+	{"private_clean",   "clean private pages"},
+	{"private_dirty",   "dirty private pages"},
+	{"anonymous",       "anonymous memory"},
+	{"anon_huge_pages", "anonymous memory on transparent huge pages"},
+	{"swap",            "swapped out memory"},
+	{"swap_pss",        "proportional swapped out memory"},
+	{"locked",          "locked memory"},
+	{NULL}
+};
+
+static PyStructSequence_Desc smaps_rollup_desc = {
+	"prctl.SmapsRollup",
+	"Decoded /proc/pid/smaps_rollup, all values in bytes",
+	smaps_rollup_fields,
+	14,
+};
+
+static char proc_stat_doc[] =
+"proc_stat(pid=0) -> ProcStat\n\n\
+Return /proc/pid/stat of pid, by default the calling process, decoded.\n\
+";
+
+static char proc_status_doc[] =
+"proc_status(pid=0) -> ProcStatus\n\n\
+Return the memory, thread and context switch figures of\n\
+/proc/pid/status, with sizes in bytes.\n\
+";
+
+static char smaps_rollup_doc[] =
+"smaps_rollup(pid=0) -> SmapsRollup\n\n\
+Return /proc/pid/smaps_rollup decoded, with sizes in bytes.\n\
+";
+
+static void _proc_path(char *path, size_t size, pid_t pid, pid_t tid,
+		       const char *name)
+{
+	if (pid && tid)
+		snprintf(path, size, "/proc/%d/task/%d/%s", pid, tid, name);
+	else if (tid)
+		snprintf(path, size, "/proc/self/task/%d/%s", tid, name);
+	else if (pid)
+		snprintf(path, size, "/proc/%d/%s", pid, name);
+	else
+		snprintf(path, size, "/proc/self/%s", name);
+}
+
+static int _read_proc(pid_t pid, pid_t tid, const char *name)
+{
+	char path[64];
+	int len;
+
+	_proc_path(path, sizeof(path), pid, tid, name);
+
+	len = _read_sysfs(path, _proc_buf, sizeof(_proc_buf));
+	if (len < 0)
+		PyErr_SetFromErrnoWithFilename(ErrorObject, path);
+
+	return len;
+}
+
+/*
+ * Decode "Name: value [kB]" lines into values, in table order.
+ */
+static void _proc_fields(char *buf, const struct proc_field *table, int count,
+			 unsigned long long *values)
+{
+	char *line, *next, *colon;
+	int i;
+
+	memset(values, 0, count * sizeof(*values));
+
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		colon = strchr(line, ':');
+		if (!colon)
+			continue;
+
+		for (i = 0; i < count; i++) {
+			if (strncmp(line, table[i].name, colon - line) ||
+			    table[i].name[colon - line])
+				continue;
+
+			values[i] = strtoull(colon + 1, NULL, 10);
+			if (table[i].kb)
+				values[i] <<= 10;
+			break;
+		}
+	}
+}
+
+static PyObject *_proc_struct(PyTypeObject *type, unsigned long long *values,
+			      int count)
+{
+	PyObject *result;
+	int i;
+
+	result = PyStructSequence_New(type);
+	if (!result)
+		return NULL;
+
+	for (i = 0; i < count; i++)
+		PyStructSequence_SET_ITEM(result, i,
+			PyLong_FromUnsignedLongLong(values[i]));
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+/*
+ * Fields of a stat line after the command name, 1-based as in proc(5).
+ */
+struct proc_stat {
+	int                pid;
+	char               comm[64];
+	char               state;
+	int                ppid;
+	unsigned long      minflt;
+	unsigned long      majflt;
+	unsigned long      utime;
+	unsigned long      stime;
+	long               priority;
+	long               nice;
+	long               num_threads;
+	unsigned long long starttime;
+	unsigned long      vsize;
+	long               rss;
+	int                processor;
+	unsigned long long blkio_delay;
+};
+
+static int _parse_stat(char *buf, struct proc_stat *stat)
+{
+	char *open, *close;
+	size_t len;
+
+	memset(stat, 0, sizeof(*stat));
+
+	/* the command name may itself contain spaces and parentheses */
+	open  = strchr(buf, '(');
+	close = strrchr(buf, ')');
+	if (!open || !close || close < open)
+		return -1;
+
+	stat->pid = atoi(buf);
+
+	len = close - open - 1;
+	if (len >= sizeof(stat->comm))
+		len = sizeof(stat->comm) - 1;
+	memcpy(stat->comm, open + 1, len);
+	stat->comm[len] = '\0';
+
+	if (sscanf(close + 2,
+		   "%c %d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu "
+		   "%*d %*d %ld %ld %ld %*d %llu %lu %ld %*u %*u %*u %*u "
+		   "%*u %*u %*u %*u %*u %*u %*u %*u %*u %*d %d %*u %*u %llu",
+		   &stat->state, &stat->ppid, &stat->minflt, &stat->majflt,
+		   &stat->utime, &stat->stime, &stat->priority, &stat->nice,
+		   &stat->num_threads, &stat->starttime, &stat->vsize,
+		   &stat->rss, &stat->processor, &stat->blkio_delay) < 13)
+		return -1;
+
+	return 0;
+}
+
+static PyObject *py_proc_stat(PyObject *self, PyObject *args)
+{
+	double tick = sysconf(_SC_CLK_TCK);
+	long page = sysconf(_SC_PAGESIZE);
+	struct proc_stat stat;
+	PyObject *result;
+	int pid = 0;
+
+	if (!PyArg_ParseTuple(args, "|i", &pid))
+		return NULL;
+
+	if (_read_proc(pid, 0, "stat") < 0)
+		return NULL;
+
+	if (_parse_stat(_proc_buf, &stat) < 0) {
+		PyErr_SetString(ErrorObject, "malformed stat line");
+		return NULL;
+	}
+
+	result = PyStructSequence_New(&ProcStatType);
+	if (!result)
+		return NULL;
+
+	PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(stat.pid));
+	PyStructSequence_SET_ITEM(result, 1, PyString_FromString(stat.comm));
+	PyStructSequence_SET_ITEM(result, 2,
+		PyString_FromStringAndSize(&stat.state, 1));
+	PyStructSequence_SET_ITEM(result, 3, PyInt_FromLong(stat.ppid));
+	PyStructSequence_SET_ITEM(result, 4, PyLong_FromUnsignedLong(stat.minflt));
+	PyStructSequence_SET_ITEM(result, 5, PyLong_FromUnsignedLong(stat.majflt));
+	PyStructSequence_SET_ITEM(result, 6, PyFloat_FromDouble(stat.utime / tick));
+	PyStructSequence_SET_ITEM(result, 7, PyFloat_FromDouble(stat.stime / tick));
+	PyStructSequence_SET_ITEM(result, 8, PyInt_FromLong(stat.priority));
+	PyStructSequence_SET_ITEM(result, 9, PyInt_FromLong(stat.nice));
+	PyStructSequence_SET_ITEM(result, 10, PyInt_FromLong(stat.num_threads));
+	PyStructSequence_SET_ITEM(result, 11,
+		PyFloat_FromDouble(stat.starttime / tick));
+	PyStructSequence_SET_ITEM(result, 12, PyLong_FromUnsignedLong(stat.vsize));
+	PyStructSequence_SET_ITEM(result, 13,
+		PyLong_FromLongLong((long long)stat.rss * page));
+	PyStructSequence_SET_ITEM(result, 14, PyInt_FromLong(stat.processor));
+	PyStructSequence_SET_ITEM(result, 15,
+		PyFloat_FromDouble(stat.blkio_delay / tick));
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+static PyObject *py_proc_status(PyObject *self, PyObject *args)
+{
+	unsigned long long values[11];
+	int pid = 0;
+
+	if (!PyArg_ParseTuple(args, "|i", &pid))
+		return NULL;
+
+	if (_read_proc(pid, 0, "status") < 0)
+		return NULL;
+
+	_proc_fields(_proc_buf, proc_status_table, 11, values);
+	return _proc_struct(&ProcStatusType, values, 11);
+}
+
+static PyObject *py_smaps_rollup(PyObject *self, PyObject *args)
+{
+	unsigned long long values[14];
+	int pid = 0;
+
+	if (!PyArg_ParseTuple(args, "|i", &pid))
+		return NULL;
+
+	if (_read_proc(pid, 0, "smaps_rollup") < 0)
+		return NULL;
+
+	_proc_fields(_proc_buf, smaps_rollup_table, 14, values);
+	return _proc_struct(&SmapsRollupType, values, 14);
+}
+
+
+/*
+ * Per-thread accounting.
+ */
+static PyTypeObject ThreadStatType;
+static PyTypeObject ThreadTimesType;
+
+static PyStructSequence_Field thread_stat_fields[] = {
+	{"tid",         "thread id"},
+	{"name",        "kernel thread name, as set by PR_SET_NAME"},
+	{"state",       "scheduling state (R, S, D, ...)"},
+	{"utime",       "user time in seconds"},
+	{"stime",       "system time in seconds"},
+	{"run_ns",      "nanoseconds spent running, from schedstat"},
+	{"wait_ns",     "nanoseconds spent waiting on a run queue"},
+	{"timeslices",  "number of timeslices run on a cpu"},
+	{"voluntary_ctxt_switches",    "voluntary context switches"},
+	{"nonvoluntary_ctxt_switches", "involuntary context switches"},
+	{"processor",   "cpu last run on"},
+	{NULL}
+};
+
+static PyStructSequence_Desc thread_stat_desc = {
+	"prctl.ThreadStat",
+	"Accounting of one thread, from /proc/pid/task/tid",
+	thread_stat_fields,
+	11,
+};
+
+static PyStructSequence_Field thread_times_fields[] = {
+	{"tid",    "thread id"},
+	{"cpu",    "cpu time in seconds, from CLOCK_THREAD_CPUTIME_ID"},
+	{"utime",  "user time in seconds"},
+	{"stime",  "system time in seconds"},
+	{"minflt", "minor page faults"},
+	{"majflt", "major page faults"},
+	{"nvcsw",  "voluntary context switches"},
+	{"nivcsw", "involuntary context switches"},
+	{NULL}
+};
+
+static PyStructSequence_Desc thread_times_desc = {
+	"prctl.ThreadTimes",
+	"Resource usage of the calling thread",
+	thread_times_fields,
+	8,
+};
+
+static const struct proc_field thread_status_table[] = {
+	{"voluntary_ctxt_switches", 0},
+	{"nonvoluntary_ctxt_switches", 0},
+};
+
+static char threads_doc[] =
+"threads(pid=0) -> list of ThreadStat\n\n\
+Return the cpu time, run queue wait, context switches and last cpu of\n\
+every thread of pid, by default the calling process. Threads exiting\n\
+during the scan are left out; other read errors, such as EACCES, raise\n\
+PrctlError.\n\
+";
+
+static char thread_times_doc[] =
+"thread_times() -> ThreadTimes\n\n\
+Return the cpu time, page faults and context switches of the calling\n\
+thread without going through /proc.\n\
+";
+
+/*
+ * ENOENT and ESRCH mean the thread exited under us; any other read
+ * error is raised against path.
+ */
+static PyObject *_thread_gone(const char *path)
+{
+	if (errno != ENOENT && errno != ESRCH)
+		PyErr_SetFromErrnoWithFilename(ErrorObject, (char *)path);
+	return NULL;
+}
+
+/*
+ * Read one thread; returns NULL without an exception set when the
+ * thread went away in the meantime.
+ */
+static PyObject *_thread_stat(pid_t pid, pid_t tid, double tick)
+{
+	unsigned long long run = 0, wait = 0, slices = 0;
+	unsigned long long switches[2];
+	struct proc_stat stat;
+	PyObject *result;
+	char path[64];
+
+	_proc_path(path, sizeof(path), pid, tid, "stat");
+	if (_read_sysfs(path, _proc_buf, sizeof(_proc_buf)) < 0)
+		return _thread_gone(path);
+	if (_parse_stat(_proc_buf, &stat) < 0)
+		return NULL;
+
+	/* schedstat is absent without CONFIG_SCHED_INFO */
+	_proc_path(path, sizeof(path), pid, tid, "schedstat");
+	if (_read_sysfs(path, _proc_buf, sizeof(_proc_buf)) >= 0)
+		sscanf(_proc_buf, "%llu %llu %llu", &run, &wait, &slices);
+
+	_proc_path(path, sizeof(path), pid, tid, "status");
+	if (_read_sysfs(path, _proc_buf, sizeof(_proc_buf)) < 0)
+		return _thread_gone(path);
+	_proc_fields(_proc_buf, thread_status_table, 2, switches);
+
+	result = PyStructSequence_New(&ThreadStatType);
+	if (!result)
+		return NULL;
+
+	PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(tid));
+	PyStructSequence_SET_ITEM(result, 1, PyString_FromString(stat.comm));
+	PyStructSequence_SET_ITEM(result, 2,
+		PyString_FromStringAndSize(&stat.state, 1));
+	PyStructSequence_SET_ITEM(result, 3, PyFloat_FromDouble(stat.utime / tick));
+	PyStructSequence_SET_ITEM(result, 4, PyFloat_FromDouble(stat.stime / tick));
+	PyStructSequence_SET_ITEM(result, 5, PyLong_FromUnsignedLongLong(run));
+	PyStructSequence_SET_ITEM(result, 6, PyLong_FromUnsignedLongLong(wait));
+	PyStructSequence_SET_ITEM(result, 7, PyLong_FromUnsignedLongLong(slices));
+	PyStructSequence_SET_ITEM(result, 8,
+		PyLong_FromUnsignedLongLong(switches[0]));
+	PyStructSequence_SET_ITEM(result, 9,
+		PyLong_FromUnsignedLongLong(switches[1]));
+	PyStructSequence_SET_ITEM(result, 10, PyInt_FromLong(stat.processor));
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+static PyObject *py_threads(PyObject *self, PyObject *args)
+{
+	double tick = sysconf(_SC_CLK_TCK);
+	PyObject *result, *item;
+	struct dirent *entry;
+	char path[64];
+	DIR *dir;
+	int pid = 0;
+	pid_t tid;
+
+	if (!PyArg_ParseTuple(args, "|i", &pid))
+		return NULL;
+
+	_proc_path(path, sizeof(path), pid, 0, "task");
+	dir = opendir(path);
+	if (!dir)
+		return PyErr_SetFromErrnoWithFilename(ErrorObject, path);
+
+	result = PyList_New(0);
+	if (!result)
+		goto out;
+
+	while ((entry = readdir(dir))) {
+		tid = atoi(entry->d_name);
+		if (tid <= 0)
+			continue;
+
+		item = _thread_stat(pid, tid, tick);
+		if (!item) {
+			if (PyErr_Occurred())
+				goto error;
+			continue;
+		}
+
+		if (PyList_Append(result, item) < 0) {
+			Py_DECREF(item);
+			goto error;
+		}
+		Py_DECREF(item);
+	}
+
+	goto out;
+
+error:
+	Py_CLEAR(result);
+out:
+	closedir(dir);
+	return result;
+}
+
+static double _timeval_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static PyObject *py_thread_times(PyObject *self, PyObject *noargs)
+{
+	struct timespec ts;
+	struct rusage ru;
+	PyObject *result;
+
+	if (getrusage(RUSAGE_THREAD, &ru) < 0 ||
+	    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	result = PyStructSequence_New(&ThreadTimesType);
+	if (!result)
+		return NULL;
+
+	PyStructSequence_SET_ITEM(result, 0,
+		PyInt_FromLong(syscall(SYS_gettid)));
+	PyStructSequence_SET_ITEM(result, 1,
+		PyFloat_FromDouble(ts.tv_sec + ts.tv_nsec / 1e9));
+	PyStructSequence_SET_ITEM(result, 2,
+		PyFloat_FromDouble(_timeval_seconds(&ru.ru_utime)));
+	PyStructSequence_SET_ITEM(result, 3,
+		PyFloat_FromDouble(_timeval_seconds(&ru.ru_stime)));
+	PyStructSequence_SET_ITEM(result, 4, PyInt_FromLong(ru.ru_minflt));
+	PyStructSequence_SET_ITEM(result, 5, PyInt_FromLong(ru.ru_majflt));
+	PyStructSequence_SET_ITEM(result, 6, PyInt_FromLong(ru.ru_nvcsw));
+	PyStructSequence_SET_ITEM(result, 7, PyInt_FromLong(ru.ru_nivcsw));
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+
+/*
+ * Resource usage meters.
+ *
+ * A Meter keeps, for a bounded number of labels allocated up front, the
+ * summed resource usage of every measured region and a histogram of its
+ * cpu time. Entering and leaving a region each take one snapshot of the
+ * calling thread's usage into the scope object, so the hot path neither
+ * allocates nor creates Python objects beyond the scope itself.
+ */
+#define METER_BUCKETS 16
+
+struct usage {
+	long long wall;     /* ns */
+	long long cpu;      /* ns */
+	long long utime;    /* us */
+	long long stime;    /* us */
+	long long minflt;
+	long long majflt;
+	long long nvcsw;
+	long long nivcsw;
+	long long inblock;
+	long long oublock;
+};
+
+struct meter_slot {
+	unsigned long long count;
+	struct usage       total;
+	unsigned long long buckets[METER_BUCKETS + 1];
+};
+
+typedef struct {
+	PyObject_HEAD
+	PyObject          *labels;  /* label -> slot index */
+	int                capacity;
+	int                nbounds;
+	long long          bounds[METER_BUCKETS];  /* ns */
+	struct meter_slot *slots;
+} MeterObject;
+
+static PyTypeObject MeterType;
+static PyTypeObject MeteredType;
+static PyTypeObject MeterStatsType;
+
+typedef struct {
+	PyObject_HEAD
+	MeterObject *meter;
+	int          slot;
+	PyObject    *func;
+} MeteredObject;
+
+static PyStructSequence_Field meter_stats_fields[] = {
+	{"count",     "number of measured regions"},
+	{"wall",      "summed wall clock time in seconds"},
+	{"cpu",       "summed thread cpu time in seconds"},
+	{"utime",     "summed user time in seconds"},
+	{"stime",     "summed system time in seconds"},
+	{"minflt",    "minor page faults"},
+	{"majflt",    "major page faults"},
+	{"nvcsw",     "voluntary context switches"},
+	{"nivcsw",    "involuntary context switches"},
+	{"inblock",   "block input operations"},
+	{"oublock",   "block output operations"},
+	{"histogram", "region counts per cpu time bucket, see Meter.bounds"},
+	{NULL}
+};
+
+static PyStructSequence_Desc meter_stats_desc = {
+	"prctl.MeterStats",
+	"Accumulated resource usage of one label of a Meter",
+	meter_stats_fields,
+	12,
+};
+
+static char meter_doc[] =
+"Meter(capacity=64, bounds=None) -> meter object\n\n\
+Accumulate the resource usage of the calling thread over measured\n\
+regions, per label. At most capacity labels are tracked. bounds are the\n\
+upper edges in seconds of the cpu time histogram buckets, at most 16 in\n\
+increasing order, and default to decades from 10us to 1s; a last bucket\n\
+counts everything above them.\n\
+";
+
+static char meter_measure_doc[] =
+"measure(label) -> context manager\n\n\
+Measure the enclosed block under label.\n\
+";
+
+static char meter_wrap_doc[] =
+"wrap(label) -> decorator\n\n\
+Return a decorator measuring every call of the function under label.\n\
+";
+
+static char meter_stats_doc[] =
+"stats() -> dict\n\n\
+Return a MeterStats for every label seen so far.\n\
+";
+
+static char meter_reset_doc[] =
+"reset() -> None\n\n\
+Zero the accumulated usage, keeping the labels.\n\
+";
+
+static char usage_snapshot_doc[] =
+"usage_snapshot() -> tuple\n\n\
+Return (wall_ns, cpu_ns, utime_us, stime_us, minflt, majflt, nvcsw,\n\
+nivcsw, inblock, oublock) of the calling thread, as taken by a Meter.\n\
+";
+
+static int _usage_snapshot(struct usage *usage)
+{
+	struct timespec wall, cpu;
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru) < 0 ||
+	    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) < 0 ||
+	    clock_gettime(CLOCK_MONOTONIC, &wall) < 0)
+		return -1;
+
+	usage->wall    = wall.tv_sec * 1000000000LL + wall.tv_nsec;
+	usage->cpu     = cpu.tv_sec * 1000000000LL + cpu.tv_nsec;
+	usage->utime   = ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec;
+	usage->stime   = ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+	usage->minflt  = ru.ru_minflt;
+	usage->majflt  = ru.ru_majflt;
+	usage->nvcsw   = ru.ru_nvcsw;
+	usage->nivcsw  = ru.ru_nivcsw;
+	usage->inblock = ru.ru_inblock;
+	usage->oublock = ru.ru_oublock;
+
+	return 0;
+}
+
+static void _meter_account(MeterObject *meter, int index,
+			   const struct usage *start, const struct usage *end)
+{
+	struct meter_slot *slot = &meter->slots[index];
+	const long long *a = (const long long *)start;
+	const long long *b = (const long long *)end;
+	long long *total = (long long *)&slot->total;
+	long long cpu = end->cpu - start->cpu;
+	size_t i;
+	int bucket;
+
+	for (i = 0; i < sizeof(struct usage) / sizeof(long long); i++)
+		total[i] += b[i] - a[i];
+
+	for (bucket = 0; bucket < meter->nbounds; bucket++)
+		if (cpu <= meter->bounds[bucket])
+			break;
+
+	slot->buckets[bucket]++;
+	slot->count++;
+}
+
+/*
+ * Look up the slot of label, assigning the next free one on first use.
+ */
+static int _meter_slot(MeterObject *self, PyObject *label)
+{
+	Py_ssize_t count;
+	PyObject *index;
+	int result;
+
+	index = PyDict_GetItem(self->labels, label);
+	if (index)
+		return PyInt_AS_LONG(index);
+	if (PyErr_Occurred())
+		return -1;
+
+	count = PyDict_Size(self->labels);
+	if (count >= self->capacity) {
+		PyErr_Format(PyExc_ValueError, "meter is full (%d labels)",
+			     self->capacity);
+		return -1;
+	}
+
+	index = PyInt_FromSsize_t(count);
+	if (!index)
+		return -1;
+
+	result = PyDict_SetItem(self->labels, label, index);
+	Py_DECREF(index);
+
+	return result < 0 ? -1 : (int)count;
+}
+
+static PyObject *Meter_new(PyTypeObject *type, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"capacity", "bounds", NULL};
+	static const double decades[] = {1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1.0};
+	PyObject *bounds = Py_None, *seq = NULL;
+	MeterObject *self;
+	int capacity = 64;
+	double edge;
+	int i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|iO:Meter", kwlist,
+					 &capacity, &bounds))
+		return NULL;
+
+	if (capacity <= 0) {
+		PyErr_SetString(PyExc_ValueError, "capacity must be positive");
+		return NULL;
+	}
+
+	self = (MeterObject *)type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+
+	self->capacity = capacity;
+
+	if (bounds == Py_None) {
+		self->nbounds = sizeof(decades) / sizeof(decades[0]);
+		for (i = 0; i < self->nbounds; i++)
+			self->bounds[i] = decades[i] * 1e9;
+	} else {
+		seq = PySequence_Fast(bounds, "bounds must be a sequence");
+		if (!seq)
+			goto error;
+
+		if (PySequence_Fast_GET_SIZE(seq) > METER_BUCKETS) {
+			PyErr_Format(PyExc_ValueError,
+				     "at most %d bounds are supported",
+				     METER_BUCKETS);
+			goto error;
+		}
+
+		self->nbounds = PySequence_Fast_GET_SIZE(seq);
+		for (i = 0; i < self->nbounds; i++) {
+			edge = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+			if (edge == -1.0 && PyErr_Occurred())
+				goto error;
+
+			self->bounds[i] = edge * 1e9;
+			if (i && self->bounds[i] <= self->bounds[i - 1]) {
+				PyErr_SetString(PyExc_ValueError,
+						"bounds must be increasing");
+				goto error;
+			}
+		}
+		Py_CLEAR(seq);
+	}
+
+	self->labels = PyDict_New();
+	if (!self->labels)
+		goto error;
+
+	self->slots = PyMem_New(struct meter_slot, capacity);
+	if (!self->slots) {
+		PyErr_NoMemory();
+		goto error;
+	}
+	memset(self->slots, 0, capacity * sizeof(struct meter_slot));
+
+	return (PyObject *)self;
+
+error:
+	Py_XDECREF(seq);
+	Py_DECREF(self);
+	return NULL;
+}
+
+static void Meter_dealloc(MeterObject *self)
+{
+	Py_XDECREF(self->labels);
+	PyMem_Free(self->slots);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int _meter_scope_enter(ScopeObject *self)
+{
+	if (_usage_snapshot((struct usage *)self->state) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _meter_scope_exit(ScopeObject *self)
+{
+	struct usage end;
+
+	if (_usage_snapshot(&end) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	_meter_account((MeterObject *)self->owner, self->slot,
+		       (struct usage *)self->state, &end);
+	return 0;
+}
+
+static struct scope_ops meter_scope_ops = {
+	_meter_scope_enter,
+	_meter_scope_exit,
+};
+
+static PyObject *Meter_measure(MeterObject *self, PyObject *label)
+{
+	ScopeObject *scope;
+	int slot;
+
+	slot = _meter_slot(self, label);
+	if (slot < 0)
+		return NULL;
+
+	scope = (ScopeObject *)_scope_new(&meter_scope_ops, 0, NULL);
+	if (!scope)
+		return NULL;
+
+	Py_INCREF(self);
+	scope->owner = (PyObject *)self;
+	scope->slot  = slot;
+
+	return (PyObject *)scope;
+}
+
+static PyObject *_meter_decorate(PyObject *bound, PyObject *func)
+{
+	MeteredObject *metered;
+
+	if (!PyCallable_Check(func)) {
+		PyErr_SetString(PyExc_TypeError, "argument must be callable");
+		return NULL;
+	}
+
+	metered = PyObject_New(MeteredObject, &MeteredType);
+	if (!metered)
+		return NULL;
+
+	metered->meter = (MeterObject *)PyTuple_GET_ITEM(bound, 0);
+	metered->slot  = PyInt_AS_LONG(PyTuple_GET_ITEM(bound, 1));
+	metered->func  = func;
+	Py_INCREF(metered->meter);
+	Py_INCREF(func);
+
+	return (PyObject *)metered;
+}
+
+static PyMethodDef _meter_decorate_def = {
+	"decorator", (PyCFunction)_meter_decorate, METH_O, NULL
+};
+
+static PyObject *Meter_wrap(MeterObject *self, PyObject *label)
+{
+	PyObject *bound, *result;
+	int slot;
+
+	slot = _meter_slot(self, label);
+	if (slot < 0)
+		return NULL;
+
+	bound = Py_BuildValue("(Oi)", self, slot);
+	if (!bound)
+		return NULL;
+
+	result = PyCFunction_New(&_meter_decorate_def, bound);
+	Py_DECREF(bound);
+
+	return result;
+}
+
+static PyObject *_meter_stats(MeterObject *self, struct meter_slot *slot)
+{
+	PyObject *result, *histogram;
+	int i;
+
+	histogram = PyTuple_New(self->nbounds + 1);
+	if (!histogram)
+		return NULL;
+
+	for (i = 0; i <= self->nbounds; i++)
+		PyTuple_SET_ITEM(histogram, i,
+			PyLong_FromUnsignedLongLong(slot->buckets[i]));
+
+	result = PyStructSequence_New(&MeterStatsType);
+	if (!result) {
+		Py_DECREF(histogram);
+		return NULL;
+	}
+
+	PyStructSequence_SET_ITEM(result, 0,
+		PyLong_FromUnsignedLongLong(slot->count));
+	PyStructSequence_SET_ITEM(result, 1,
+		PyFloat_FromDouble(slot->total.wall / 1e9));
+	PyStructSequence_SET_ITEM(result, 2,
+		PyFloat_FromDouble(slot->total.cpu / 1e9));
+	PyStructSequence_SET_ITEM(result, 3,
+		PyFloat_FromDouble(slot->total.utime / 1e6));
+	PyStructSequence_SET_ITEM(result, 4,
+		PyFloat_FromDouble(slot->total.stime / 1e6));
+	PyStructSequence_SET_ITEM(result, 5,
+		PyLong_FromLongLong(slot->total.minflt));
+	PyStructSequence_SET_ITEM(result, 6,
+		PyLong_FromLongLong(slot->total.majflt));
+	PyStructSequence_SET_ITEM(result, 7,
+		PyLong_FromLongLong(slot->total.nvcsw));
+	PyStructSequence_SET_ITEM(result, 8,
+		PyLong_FromLongLong(slot->total.nivcsw));
+	PyStructSequence_SET_ITEM(result, 9,
+		PyLong_FromLongLong(slot->total.inblock));
+	PyStructSequence_SET_ITEM(result, 10,
+		PyLong_FromLongLong(slot->total.oublock));
+	PyStructSequence_SET_ITEM(result, 11, histogram);
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+static PyObject *Meter_stats(MeterObject *self)
+{
+	PyObject *result, *label, *index, *stats;
+	Py_ssize_t pos = 0;
+
+	result = PyDict_New();
+	if (!result)
+		return NULL;
+
+	while (PyDict_Next(self->labels, &pos, &label, &index)) {
+		stats = _meter_stats(self, &self->slots[PyInt_AS_LONG(index)]);
+		if (!stats || PyDict_SetItem(result, label, stats) < 0) {
+			Py_XDECREF(stats);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(stats);
+	}
+
+	return result;
+}
+
+static PyObject *Meter_reset(MeterObject *self)
+{
+	memset(self->slots, 0, self->capacity * sizeof(struct meter_slot));
+	Py_RETURN_NONE;
+}
+
+static PyObject *Meter_get_bounds(MeterObject *self, void *closure)
+{
+	PyObject *result;
+	int i;
+
+	result = PyTuple_New(self->nbounds);
+	if (!result)
+		return NULL;
+
+	for (i = 0; i < self->nbounds; i++)
+		PyTuple_SET_ITEM(result, i,
+			PyFloat_FromDouble(self->bounds[i] / 1e9));
+
+	return result;
+}
+
+static Py_ssize_t Meter_length(MeterObject *self)
+{
+	return PyDict_Size(self->labels);
+}
+
+static PyMethodDef Meter_methods[] = {
+	{"measure", (PyCFunction)Meter_measure, METH_O, meter_measure_doc},
+	{"wrap", (PyCFunction)Meter_wrap, METH_O, meter_wrap_doc},
+	{"stats", (PyCFunction)Meter_stats, METH_NOARGS, meter_stats_doc},
+	{"reset", (PyCFunction)Meter_reset, METH_NOARGS, meter_reset_doc},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef Meter_getset[] = {
+	{"bounds", (getter)Meter_get_bounds, NULL,
+	 "upper edges of the histogram buckets in seconds", NULL},
+	{NULL}
+};
+
+static PySequenceMethods Meter_as_sequence = {
+	(lenfunc)Meter_length,
+};
+
+static PyTypeObject MeterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"prctl.Meter",
+	sizeof(MeterObject),
+	0,
+	(destructor)Meter_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	&Meter_as_sequence,			/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	meter_doc,				/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	Meter_methods,				/* tp_methods */
+	0,					/* tp_members */
+	Meter_getset,				/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	0,					/* tp_init */
+	0,					/* tp_alloc */
+	Meter_new,				/* tp_new */
+};
+
+static void Metered_dealloc(MeteredObject *self)
+{
+	Py_XDECREF(self->meter);
+	Py_XDECREF(self->func);
+	PyObject_Del(self);
+}
+
+static PyObject *Metered_call(MeteredObject *self, PyObject *args,
+			      PyObject *kw)
+{
+	struct usage start, end;
+	PyObject *result;
+
+	if (_usage_snapshot(&start) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	result = PyObject_Call(self->func, args, kw);
+
+	if (_usage_snapshot(&end) == 0)
+		_meter_account(self->meter, self->slot, &start, &end);
+
+	return result;
+}
+
+/* bind like a plain function so methods can be decorated too */
+static PyObject *Metered_get(PyObject *self, PyObject *obj, PyObject *type)
+{
+	if (!obj || obj == Py_None) {
+		Py_INCREF(self);
+		return self;
+	}
+
+	return PyMethod_New(self, obj, type);
+}
+
+static PyTypeObject MeteredType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"prctl.Metered",
+	sizeof(MeteredObject),
+	0,
+	(destructor)Metered_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	(ternaryfunc)Metered_call,		/* tp_call */
+	0,					/* tp_str */
+	PyObject_GenericGetAttr,		/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	"Function measured by a Meter",		/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	0,					/* tp_methods */
+	0,					/* tp_members */
+	0,					/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	Metered_get,				/* tp_descr_get */
+};
+
+static PyObject *py_usage_snapshot(PyObject *self, PyObject *noargs)
+{
+	struct usage usage;
+
+	if (_usage_snapshot(&usage) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	return Py_BuildValue("(LLLLLLLLLL)", usage.wall, usage.cpu,
+			     usage.utime, usage.stime, usage.minflt,
+			     usage.majflt, usage.nvcsw, usage.nivcsw,
+			     usage.inblock, usage.oublock);
+}
+
+
+/*
+ * Current cpu and node through restartable sequences.
+ *
+ * The kernel keeps cpu_id and node_id of a registered rseq area up to
+ * date on every migration, so reading them is a plain load. glibc 2.35
+ * and later registers an area for every thread and publishes its offset
+ * from the thread pointer; without that we register our own, per thread,
+ * on first use. sched_getcpu() and getcpu(2) remain as fallbacks.
+ */
+#ifndef SYS_rseq
+#define SYS_rseq 334
+#endif
+
+#ifndef AT_RSEQ_FEATURE_SIZE
+#define AT_RSEQ_FEATURE_SIZE 27
+#endif
+
+#define RSEQ_SIG 0x53053053
+
+struct rseq_area {
+	unsigned int       cpu_id_start;
+	unsigned int       cpu_id;
+	unsigned long long rseq_cs;
+	unsigned int       flags;
+	unsigned int       node_id;
+	unsigned int       mm_cid;
+} __attribute__((aligned(32)));
+
+enum {
+	RSEQ_UNKNOWN,
+	RSEQ_GLIBC,
+	RSEQ_OWN,
+	RSEQ_NONE,
+};
+
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+static __thread struct rseq_area  _rseq_own;
+static __thread struct rseq_area *_rseq_area;
+static __thread int               _rseq_state;
+
+static char current_cpu_doc[] =
+"current_cpu() -> int\n\n\
+Return the cpu the calling thread is running on, read from its rseq\n\
+area.\n\
+";
+
+static char current_node_doc[] =
+"current_node() -> int\n\n\
+Return the NUMA node the calling thread is running on, read from its\n\
+rseq area on kernels which provide node_id (6.3 and later).\n\
+";
+
+static char rseq_status_doc[] =
+"rseq_status() -> str or None\n\n\
+Return 'glibc' or 'prctl' depending on who registered the rseq area\n\
+read by current_cpu() for the calling thread, or None when the\n\
+syscall fallbacks are used.\n\
+";
+
+static struct rseq_area *_rseq_attach(void)
+{
+	if (_rseq_state == RSEQ_UNKNOWN) {
+		_rseq_state = RSEQ_NONE;
+
+		if (&__rseq_size && &__rseq_offset && __rseq_size) {
+			_rseq_area = (struct rseq_area *)
+				((char *)__builtin_thread_pointer() + __rseq_offset);
+			_rseq_state = RSEQ_GLIBC;
+		} else if (syscall(SYS_rseq, &_rseq_own, sizeof(_rseq_own), 0,
+				   RSEQ_SIG) == 0) {
+			_rseq_area = &_rseq_own;
+			_rseq_state = RSEQ_OWN;
+		}
+	}
+
+	return _rseq_area;
+}
+
+static int _rseq_has_node(void)
+{
+	static int has_node = -1;
+
+	if (has_node < 0)
+		has_node = getauxval(AT_RSEQ_FEATURE_SIZE) >=
+			offsetof(struct rseq_area, node_id) + sizeof(unsigned int);
+
+	return has_node;
+}
+
+static PyObject *py_current_cpu(PyObject *self, PyObject *noargs)
+{
+	struct rseq_area *area = _rseq_area;
+	int cpu;
+
+	if (!area)
+		area = _rseq_attach();
+
+	if (area) {
+		cpu = *(volatile int *)&area->cpu_id;
+		if (cpu >= 0)
+			return PyInt_FromLong(cpu);
+	}
+
+	cpu = sched_getcpu();
+	if (cpu < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	return PyInt_FromLong(cpu);
+}
+
+static PyObject *py_current_node(PyObject *self, PyObject *noargs)
+{
+	struct rseq_area *area = _rseq_area;
+	unsigned int cpu, node;
+
+	if (!area)
+		area = _rseq_attach();
+
+	if (area && _rseq_has_node() && *(volatile int *)&area->cpu_id >= 0)
+		return PyInt_FromLong(*(volatile unsigned int *)&area->node_id);
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	return PyInt_FromLong(node);
+}
+
+static PyObject *py_rseq_status(PyObject *self, PyObject *noargs)
+{
+	_rseq_attach();
+
+	switch (_rseq_state) {
+	case RSEQ_GLIBC:
+		return PyString_FromString("glibc");
+	case RSEQ_OWN:
+		return PyString_FromString("prctl");
+	}
+
+	Py_RETURN_NONE;
+}
+
+
+/*
+ * Reproducible benchmarking.
+ *
+ * benchmark_mode() re-executes the interpreter with address space
+ * randomisation disabled, which only takes effect at exec, and then pins
+ * the process and fixes the settings which otherwise vary from run to
+ * run. The environment variable below marks the re-executed process so
+ * the second call applies the settings instead of exec'ing again.
+ */
+#define BENCHMARK_ENV "PRCTL_BENCHMARK_MODE"
+#define CPU_ISOLATED "/sys/devices/system/cpu/isolated"
+
+static char benchmark_mode_doc[] =
+"benchmark_mode(cpu=None, timerslack=1, thp=False, perf=True, reexec=True)\n\
+    -> dict\n\n\
+Put the process into a repeatable state for performance testing. Unless\n\
+address space randomisation is already off, the interpreter is\n\
+re-executed with the same command line under ADDR_NO_RANDOMIZE and the\n\
+call only returns in the new process, which must call benchmark_mode()\n\
+again; pass reexec=False to skip this step.\n\n\
+The process is then pinned to cpu, by default an isolated cpu of the\n\
+current affinity mask or else its highest numbered one, the timer slack\n\
+is set to timerslack ns and transparent huge pages are disabled, or\n\
+left to the system policy if thp is True. With perf set, the perf\n\
+counters this process opened itself are disabled outside perf_region()\n\
+blocks; counters attached from outside, as by perf stat -p, keep\n\
+counting.\n\n\
+Returns a manifest of every applied setting, to be stored with the\n\
+results.\n\
+";
+
+static char perf_region_doc[] =
+"perf_region() -> context manager\n\n\
+Enable the perf counters opened by this process, through\n\
+perf_event_open(2), for the enclosed block and disable them again on\n\
+exit. Counters another process attached, as perf stat -p does, are\n\
+not affected.\n\
+";
+
+static int _benchmark_reexec(void)
+{
+	static char cmdline[65536];
+	char **argv;
+	int len, argc, i;
+	char *arg;
+
+	len = _read_sysfs("/proc/self/cmdline", cmdline, sizeof(cmdline));
+	if (len <= 0)
+		return -1;
+
+	for (argc = 0, i = 0; i < len; i++)
+		if (!cmdline[i])
+			argc++;
+
+	argv = alloca((argc + 1) * sizeof(char *));
+	for (i = 0, arg = cmdline; i < argc; i++, arg += strlen(arg) + 1)
+		argv[i] = arg;
+	argv[argc] = NULL;
+
+	if (setenv(BENCHMARK_ENV, "1", 1) < 0)
+		return -1;
+
+	fflush(NULL);
+	execv("/proc/self/exe", argv);
+
+	unsetenv(BENCHMARK_ENV);
+	return -1;
+}
+
+/*
+ * Prefer an isolated cpu we are allowed to run on, else the last one
+ * allowed, which tends to see the least housekeeping work.
+ */
+static int _benchmark_cpu(int *isolated)
+{
+	cpu_set_t allowed, candidates;
+	char buf[4096];
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return -1;
+
+	*isolated = 0;
+	if (_read_sysfs(CPU_ISOLATED, buf, sizeof(buf)) > 0) {
+		_parse_cpulist(buf, &candidates);
+		CPU_AND(&candidates, &candidates, &allowed);
+		if (CPU_COUNT(&candidates)) {
+			allowed = candidates;
+			*isolated = 1;
+		}
+	}
+
+	for (cpu = CPU_SETSIZE - 1; cpu >= 0; cpu--)
+		if (CPU_ISSET(cpu, &allowed))
+			return cpu;
+
+	errno = EINVAL;
+	return -1;
+}
+
+static int _manifest_set(PyObject *manifest, const char *key, PyObject *value)
+{
+	int result;
+
+	if (!value)
+		return -1;
+
+	result = PyDict_SetItemString(manifest, key, value);
+	Py_DECREF(value);
+	return result;
+}
+
+static PyObject *py_benchmark_mode(PyObject *self, PyObject *args,
+				   PyObject *kw)
+{
+	static char *kwlist[] = {"cpu", "timerslack", "thp", "perf", "reexec",
+				 NULL};
+	PyObject *cpu_arg = Py_None, *manifest;
+	unsigned long timerslack = 1;
+	int thp = 0, perf = 1, reexec = 1;
+	int persona, cpu, isolated = 0;
+	char mode[128], *open, *close;
+	cpu_set_t set;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|Okiii", kwlist, &cpu_arg,
+					 &timerslack, &thp, &perf, &reexec))
+		return NULL;
+
+	persona = personality(0xffffffff);
+	if (persona < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	if (reexec && !(persona & ADDR_NO_RANDOMIZE) && !getenv(BENCHMARK_ENV)) {
+		if (personality(persona | ADDR_NO_RANDOMIZE) < 0 ||
+		    _benchmark_reexec() < 0) {
+			personality(persona);
+			return PyErr_SetFromErrno(ErrorObject);
+		}
+	}
+
+	if (cpu_arg == Py_None) {
+		cpu = _benchmark_cpu(&isolated);
+		if (cpu < 0)
+			return PyErr_SetFromErrno(ErrorObject);
+	} else {
+		cpu = PyInt_AsLong(cpu_arg);
+		if (cpu == -1 && PyErr_Occurred())
+			return NULL;
+		if (cpu < 0 || cpu >= CPU_SETSIZE) {
+			PyErr_SetString(PyExc_ValueError, "invalid cpu");
+			return NULL;
+		}
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (_set_affinity(0, &set) < 0)
+		return NULL;
+
+	if (prctl(PR_SET_TIMERSLACK, timerslack, 0, 0, 0) < 0 ||
+	    prctl(PR_SET_THP_DISABLE, !thp, 0, 0, 0) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	if (perf && prctl(PR_TASK_PERF_EVENTS_DISABLE, 0, 0, 0, 0) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	strcpy(mode, "unknown");
+	if (_read_sysfs(THP_ENABLED, mode, sizeof(mode)) > 0 &&
+	    (open = strchr(mode, '[')) && (close = strchr(open, ']'))) {
+		*close = '\0';
+		memmove(mode, open + 1, close - open);
+	}
+
+	manifest = PyDict_New();
+	if (!manifest)
+		return NULL;
+
+	if (_manifest_set(manifest, "aslr", PyBool_FromLong(
+			!(personality(0xffffffff) & ADDR_NO_RANDOMIZE))) < 0 ||
+	    _manifest_set(manifest, "reexec", PyBool_FromLong(
+			getenv(BENCHMARK_ENV) != NULL)) < 0 ||
+	    _manifest_set(manifest, "cpu", PyInt_FromLong(cpu)) < 0 ||
+	    _manifest_set(manifest, "isolated", PyBool_FromLong(isolated)) < 0 ||
+	    _manifest_set(manifest, "timerslack", PyLong_FromUnsignedLong(
+			prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0))) < 0 ||
+	    _manifest_set(manifest, "thp_disabled", PyBool_FromLong(
+			prctl(PR_GET_THP_DISABLE, 0, 0, 0, 0) > 0)) < 0 ||
+	    _manifest_set(manifest, "thp_system",
+			  PyString_FromString(mode)) < 0 ||
+	    _manifest_set(manifest, "perf_events", PyString_FromString(
+			perf ? "perf_region" : "unchanged")) < 0) {
+		Py_DECREF(manifest);
+		return NULL;
+	}
+
+	return manifest;
+}
+
+static int _perf_region_enter(ScopeObject *self)
+{
+	if (prctl(PR_TASK_PERF_EVENTS_ENABLE, 0, 0, 0, 0) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _perf_region_exit(ScopeObject *self)
+{
+	if (prctl(PR_TASK_PERF_EVENTS_DISABLE, 0, 0, 0, 0) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct scope_ops perf_region_ops = {
+	_perf_region_enter,
+	_perf_region_exit,
+};
+
+static PyObject *py_perf_region(PyObject *self, PyObject *noargs)
+{
+	return _scope_new(&perf_region_ops, 0, NULL);
+}
+
+
+/*
+ * Process profiles.
+ *
+ * A profile is a list of "setting = value" lines, read from a file, the
+ * PRCTL_PROFILE environment variable, a dict or one of the built-in
+ * presets. It is parsed completely before anything is touched and then
+ * applied in a single pass, in an order which lets earlier settings
+ * enable later ones (rlimits before mlockall).
+ */
+#define PROFILE_ENV   "PRCTL_PROFILE"
+#define PROFILE_ITEMS 48
+
+/* in the order they are applied */
+enum {
+	PROFILE_RLIMIT,
+	PROFILE_NAME,
+	PROFILE_PDEATHSIG,
+	PROFILE_TIMERSLACK,
+	PROFILE_THP,
+	PROFILE_KSM,
+	PROFILE_SPEC,
+	PROFILE_AFFINITY,
+	PROFILE_SCHED,
+	PROFILE_NICE,
+	PROFILE_MLOCK,
+	PROFILE_KEYS,
+};
+
+struct profile_item {
+	int       key;
+	int       arg;       /* rlimit resource or speculation misfeature */
+	char      setting[32];
+	char      value[128];
+	long long number[2];
+	cpu_set_t cpus;
+	int       error;
+};
+
+struct profile {
+	int                 count;
+	struct profile_item items[PROFILE_ITEMS];
+};
+
+static const struct {
+	const char *name;
+	int         key;
+} profile_settings[] = {
+	{"name",       PROFILE_NAME},
+	{"pdeathsig",  PROFILE_PDEATHSIG},
+	{"timerslack", PROFILE_TIMERSLACK},
+	{"thp",        PROFILE_THP},
+	{"ksm",        PROFILE_KSM},
+	{"affinity",   PROFILE_AFFINITY},
+	{"sched",      PROFILE_SCHED},
+	{"nice",       PROFILE_NICE},
+	{"mlock",      PROFILE_MLOCK},
+	{NULL}
+};
+
+static const struct {
+	const char *name;
+	int         resource;
+} profile_rlimits[] = {
+	{"as",         RLIMIT_AS},
+	{"core",       RLIMIT_CORE},
+	{"cpu",        RLIMIT_CPU},
+	{"data",       RLIMIT_DATA},
+	{"fsize",      RLIMIT_FSIZE},
+	{"locks",      RLIMIT_LOCKS},
+	{"memlock",    RLIMIT_MEMLOCK},
+	{"msgqueue",   RLIMIT_MSGQUEUE},
+	{"nice",       RLIMIT_NICE},
+	{"nofile",     RLIMIT_NOFILE},
+	{"nproc",      RLIMIT_NPROC},
+	{"rss",        RLIMIT_RSS},
+	{"rtprio",     RLIMIT_RTPRIO},
+	{"rttime",     RLIMIT_RTTIME},
+	{"sigpending", RLIMIT_SIGPENDING},
+	{"stack",      RLIMIT_STACK},
+	{NULL}
+};
+
+static const struct {
+	const char *name;
+	int         misfeature;
+} profile_spec[] = {
+	{"spec_store_bypass",    PR_SPEC_STORE_BYPASS},
+	{"spec_indirect_branch", PR_SPEC_INDIRECT_BRANCH},
+	{"spec_l1d_flush",       PR_SPEC_L1D_FLUSH},
+	{NULL}
+};
+
+static const struct {
+	const char *name;
+	int         value;
+} profile_words[] = {
+	{"enable",         PR_SPEC_ENABLE},
+	{"disable",        PR_SPEC_DISABLE},
+	{"force-disable",  PR_SPEC_FORCE_DISABLE},
+	{"disable-noexec", PR_SPEC_DISABLE_NOEXEC},
+	{NULL}
+};
+
+static const struct {
+	const char *name;
+	int         policy;
+} profile_policies[] = {
+	{"other", SCHED_OTHER},
+	{"batch", SCHED_BATCH},
+	{"idle",  SCHED_IDLE},
+	{"fifo",  SCHED_FIFO},
+	{"rr",    SCHED_RR},
+	{NULL}
+};
+
+static const struct {
+	const char *name;
+	int         signal;
+} profile_signals[] = {
+	{"SIGHUP",  SIGHUP},
+	{"SIGINT",  SIGINT},
+	{"SIGQUIT", SIGQUIT},
+	{"SIGKILL", SIGKILL},
+	{"SIGUSR1", SIGUSR1},
+	{"SIGUSR2", SIGUSR2},
+	{"SIGTERM", SIGTERM},
+	{NULL}
+};
+
+static const struct {
+	const char *name;
+	const char *text;
+} profile_presets[] = {
+	{"low-latency",
+	 "timerslack = 1\n"
+	 "thp = off\n"
+	 "mlock = current,future\n"},
+	{"batch",
+	 "sched = batch\n"
+	 "nice = 10\n"
+	 "timerslack = 1000000\n"
+	 "thp = on\n"},
+	{"memory-saver",
+	 "ksm = on\n"
+	 "thp = off\n"},
+	{NULL}
+};
+
+static PyTypeObject ProfileItemType;
+
+static PyStructSequence_Field profile_item_fields[] = {
+	{"setting",   "name of the setting"},
+	{"current",   "value in effect before the profile was applied"},
+	{"requested", "value asked for by the profile"},
+	{"error",     "why applying the setting failed, None on success"},
+	{NULL}
+};
+
+static PyStructSequence_Desc profile_item_desc = {
+	"prctl.ProfileItem",
+	"One setting of an applied or dry-run profile",
+	profile_item_fields,
+	4,
+};
+
+static char apply_profile_doc[] =
+"apply_profile(profile=None, dry_run=False, strict=False) -> list\n\n\
+Apply a process profile and return a ProfileItem for each setting.\n\
+profile is a dict of settings, the name of a preset, the path of a file\n\
+or settings inline as \"key=value;key=value\". By default it is taken\n\
+from the PRCTL_PROFILE environment variable, in the same forms, and\n\
+nothing is done when that is unset. The prctl-profile.pth file installed\n\
+with the module makes this call at interpreter startup.\n\n\
+Settings: preset, name, pdeathsig, timerslack, thp (on/off), ksm\n\
+(on/off), affinity (cpu list), sched (other, batch, idle, fifo:prio or\n\
+rr:prio), nice, mlock (current, future, onfault, comma separated),\n\
+rlimit_<resource> (soft[:hard], unlimited allowed) and spec_store_bypass,\n\
+spec_indirect_branch and spec_l1d_flush (enable, disable,\n\
+force-disable, disable-noexec).\n\n\
+A malformed profile raises ValueError before anything is applied. With\n\
+dry_run only the current and requested values are reported. Settings\n\
+which fail are reported with their error, or raise PrctlError if strict\n\
+is set, after the remaining ones were applied.\n\
+";
+
+static char profile_presets_doc[] =
+"profile_presets() -> dict\n\n\
+Return the text of the built-in presets by name.\n\
+";
+
+static int _profile_number(const char *value, long long *number)
+{
+	char *end;
+
+	errno = 0;
+	*number = strtoll(value, &end, 0);
+	return (end == value || *end || errno) ? -1 : 0;
+}
+
+static int _profile_switch(const char *value)
+{
+	if (!strcmp(value, "on") || !strcmp(value, "1") ||
+	    !strcmp(value, "true"))
+		return 1;
+	if (!strcmp(value, "off") || !strcmp(value, "0") ||
+	    !strcmp(value, "false"))
+		return 0;
+	return -1;
+}
+
+static int _profile_rlimit(const char *value, long long *number)
+{
+	if (!strcmp(value, "unlimited") || !strcmp(value, "inf")) {
+		*number = (long long)RLIM_INFINITY;
+		return 0;
+	}
+
+	return _profile_number(value, number) < 0 || *number < 0 ? -1 : 0;
+}
+
+static int _profile_parse(struct profile *profile, const char *setting,
+			  const char *value);
+
+static int _profile_text(struct profile *profile, const char *text,
+			 const char *separators)
+{
+	char *copy, *line, *next, *equals, *key, *value, *end;
+	int result = 0;
+
+	copy = strdup(text);
+	if (!copy) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	for (line = copy; line && result == 0; line = next) {
+		next = line + strcspn(line, separators);
+		if (*next)
+			*next++ = '\0';
+		else
+			next = NULL;
+
+		line[strcspn(line, "#")] = '\0';
+		key = line + strspn(line, " \t\r");
+		if (!*key)
+			continue;
+
+		equals = strchr(key, '=');
+		if (!equals) {
+			PyErr_Format(PyExc_ValueError,
+				     "profile line '%.64s' lacks a value", key);
+			result = -1;
+			break;
+		}
+
+		for (end = equals; end > key && strchr(" \t=", end[-1]); end--)
+			;
+		*end = '\0';
+
+		value = equals + 1;
+		value += strspn(value, " \t");
+		for (end = value + strlen(value);
+		     end > value && strchr(" \t\r", end[-1]); end--)
+			;
+		*end = '\0';
+
+		result = _profile_parse(profile, key, value);
+	}
+
+	free(copy);
+	return result;
+}
+
+static int _profile_preset(struct profile *profile, const char *name)
+{
+	int i;
+
+	for (i = 0; profile_presets[i].name; i++)
+		if (!strcmp(profile_presets[i].name, name))
+			return _profile_text(profile, profile_presets[i].text,
+					     "\n");
+
+	PyErr_Format(PyExc_ValueError, "unknown profile preset '%.64s'", name);
+	return -1;
+}
+
+static int _profile_parse(struct profile *profile, const char *setting,
+			  const char *value)
+{
+	struct profile_item item, *slot;
+	const char *p;
+	char *end;
+	size_t len;
+	int i;
+
+	if (!strcmp(setting, "preset"))
+		return _profile_preset(profile, value);
+
+	memset(&item, 0, sizeof(item));
+	item.key = -1;
+
+	for (i = 0; profile_settings[i].name; i++)
+		if (!strcmp(profile_settings[i].name, setting))
+			item.key = profile_settings[i].key;
+
+	if (!strncmp(setting, "rlimit_", 7))
+		for (i = 0; profile_rlimits[i].name; i++)
+			if (!strcmp(profile_rlimits[i].name, setting + 7)) {
+				item.key = PROFILE_RLIMIT;
+				item.arg = profile_rlimits[i].resource;
+			}
+
+	for (i = 0; profile_spec[i].name; i++)
+		if (!strcmp(profile_spec[i].name, setting)) {
+			item.key = PROFILE_SPEC;
+			item.arg = profile_spec[i].misfeature;
+		}
+
+	if (item.key < 0) {
+		PyErr_Format(PyExc_ValueError, "unknown profile setting '%.64s'",
+			     setting);
+		return -1;
+	}
+
+	snprintf(item.setting, sizeof(item.setting), "%.31s", setting);
+	snprintf(item.value, sizeof(item.value), "%.127s", value);
+
+	switch (item.key) {
+	case PROFILE_NAME:
+		if (!*value || strlen(value) > 15)
+			goto invalid;
+		break;
+
+	case PROFILE_PDEATHSIG:
+		item.number[0] = -1;
+		for (i = 0; profile_signals[i].name; i++)
+			if (!strcmp(profile_signals[i].name, value))
+				item.number[0] = profile_signals[i].signal;
+		if (item.number[0] < 0 &&
+		    (_profile_number(value, &item.number[0]) < 0 ||
+		     item.number[0] < 0 || item.number[0] >= NSIG))
+			goto invalid;
+		break;
+
+	case PROFILE_TIMERSLACK:
+		if (_profile_number(value, &item.number[0]) < 0 ||
+		    item.number[0] < 0)
+			goto invalid;
+		break;
+
+	case PROFILE_THP:
+	case PROFILE_KSM:
+		item.number[0] = _profile_switch(value);
+		if (item.number[0] < 0)
+			goto invalid;
+		break;
+
+	case PROFILE_SPEC:
+		item.number[0] = -1;
+		for (i = 0; profile_words[i].name; i++)
+			if (!strcmp(profile_words[i].name, value))
+				item.number[0] = profile_words[i].value;
+		if (item.number[0] < 0)
+			goto invalid;
+		break;
+
+	case PROFILE_AFFINITY:
+		if (!*value || value[strspn(value, "0123456789,- ")])
+			goto invalid;
+		_parse_cpulist(value, &item.cpus);
+		if (!CPU_COUNT(&item.cpus))
+			goto invalid;
+		break;
+
+	case PROFILE_SCHED:
+		item.number[0] = -1;
+		p = strchr(value, ':');
+		len = p ? (size_t)(p - value) : strlen(value);
+		for (i = 0; profile_policies[i].name; i++)
+			if (strlen(profile_policies[i].name) == len &&
+			    !strncmp(profile_policies[i].name, value, len)) {
+				item.number[0] = profile_policies[i].policy;
+				break;
+			}
+		if (item.number[0] < 0)
+			goto invalid;
+		if (p && _profile_number(p + 1, &item.number[1]) < 0)
+			goto invalid;
+		if ((item.number[0] == SCHED_FIFO ||
+		     item.number[0] == SCHED_RR) != (item.number[1] > 0))
+			goto invalid;
+		break;
+
+	case PROFILE_NICE:
+		if (_profile_number(value, &item.number[0]) < 0 ||
+		    item.number[0] < -20 || item.number[0] > 19)
+			goto invalid;
+		break;
+
+	case PROFILE_MLOCK:
+		for (p = value; *p; p += strspn(p, ", ")) {
+			i = strcspn(p, ", ");
+			if (!strncmp(p, "current", i) && i == 7)
+				item.number[0] |= MCL_CURRENT;
+			else if (!strncmp(p, "future", i) && i == 6)
+				item.number[0] |= MCL_FUTURE;
+			else if (!strncmp(p, "onfault", i) && i == 7)
+				item.number[0] |= MCL_ONFAULT;
+			else
+				goto invalid;
+			p += i;
+		}
+		if (!(item.number[0] & (MCL_CURRENT | MCL_FUTURE)))
+			goto invalid;
+		break;
+
+	case PROFILE_RLIMIT:
+		end = strchr(item.value, ':');
+		if (end)
+			*end = '\0';
+		if (_profile_rlimit(item.value, &item.number[0]) < 0 ||
+		    _profile_rlimit(end ? end + 1 : item.value,
+				    &item.number[1]) < 0)
+			goto invalid;
+		if (end)
+			*end = ':';
+		break;
+	}
+
+	/* later settings override earlier ones, e.g. those of a preset */
+	for (i = 0; i < profile->count; i++) {
+		slot = &profile->items[i];
+		if (slot->key == item.key && slot->arg == item.arg) {
+			*slot = item;
+			return 0;
+		}
+	}
+
+	if (profile->count == PROFILE_ITEMS) {
+		PyErr_SetString(PyExc_ValueError, "too many profile settings");
+		return -1;
+	}
+
+	profile->items[profile->count++] = item;
+	return 0;
+
+invalid:
+	PyErr_Format(PyExc_ValueError, "invalid value '%.64s' for %.32s",
+		     value, setting);
+	return -1;
+}
+
+static int _profile_source(struct profile *profile, const char *source)
+{
+	char text[8192];
+
+	if (strchr(source, '='))
+		return _profile_text(profile, source, ";\n");
+
+	if (!strchr(source, '/'))
+		return _profile_preset(profile, source);
+
+	if (_read_sysfs(source, text, sizeof(text)) < 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)source);
+		return -1;
+	}
+
+	return _profile_text(profile, text, "\n");
+}
+
+static PyObject *_profile_join(PyObject *seq)
+{
+	PyObject *fast, *items, *item, *sep, *result = NULL;
+	Py_ssize_t i, count;
+
+	fast = PySequence_Fast(seq, "expected a sequence");
+	if (!fast)
+		return NULL;
+
+	count = PySequence_Fast_GET_SIZE(fast);
+	items = PyList_New(count);
+	if (!items)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		item = PyObject_Str(PySequence_Fast_GET_ITEM(fast, i));
+		if (!item)
+			goto out;
+		PyList_SET_ITEM(items, i, item);
+	}
+
+	sep = PyString_FromString(",");
+	if (sep) {
+		result = _PyString_Join(sep, items);
+		Py_DECREF(sep);
+	}
+out:
+	Py_XDECREF(items);
+	Py_DECREF(fast);
+	return result;
+}
+
+static int _profile_dict(struct profile *profile, PyObject *dict)
+{
+	PyObject *key, *value, *text;
+	Py_ssize_t pos = 0;
+	int result;
+
+	while (PyDict_Next(dict, &pos, &key, &value)) {
+		if (!PyString_Check(key)) {
+			PyErr_SetString(PyExc_TypeError,
+					"profile settings must be strings");
+			return -1;
+		}
+
+		/* lists, such as cpus or mlock flags, become comma lists */
+		if (PyList_Check(value) || PyTuple_Check(value))
+			text = _profile_join(value);
+		/* str(True) is 'True', which no switch accepts */
+		else if (PyBool_Check(value))
+			text = PyString_FromString(value == Py_True ? "1" : "0");
+		else
+			text = PyObject_Str(value);
+		if (!text)
+			return -1;
+
+		result = _profile_parse(profile, PyString_AS_STRING(key),
+					PyString_AS_STRING(text));
+		Py_DECREF(text);
+		if (result < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void _format_cpulist(cpu_set_t *set, char *buf, size_t size)
+{
+	size_t used = 0;
+	int cpu, last;
+
+	buf[0] = '\0';
+	for (cpu = 0; cpu < CPU_SETSIZE && used < size; cpu++) {
+		if (!CPU_ISSET(cpu, set))
+			continue;
+
+		for (last = cpu; last + 1 < CPU_SETSIZE &&
+		     CPU_ISSET(last + 1, set); last++)
+			;
+
+		if (last == cpu)
+			used += snprintf(buf + used, size - used, "%s%d",
+					 used ? "," : "", cpu);
+		else
+			used += snprintf(buf + used, size - used, "%s%d-%d",
+					 used ? "," : "", cpu, last);
+		cpu = last;
+	}
+}
+
+static void _format_rlimit(rlim_t value, char *buf, size_t size)
+{
+	if (value == RLIM_INFINITY)
+		snprintf(buf, size, "unlimited");
+	else
+		snprintf(buf, size, "%llu", (unsigned long long)value);
+}
+
+/*
+ * Describe the setting item controls as it currently is.
+ */
+static void _profile_current(struct profile_item *item, char *buf,
+			     size_t size)
+{
+	char soft[32], hard[32];
+	struct sched_param param;
+	struct rlimit limit;
+	cpu_set_t set;
+	int value, i;
+
+	snprintf(buf, size, "unknown");
+
+	switch (item->key) {
+	case PROFILE_NAME:
+		if (size > 16 && prctl(PR_GET_NAME, (unsigned long)buf) == 0)
+			buf[15] = '\0';
+		break;
+
+	case PROFILE_PDEATHSIG:
+		if (prctl(PR_GET_PDEATHSIG, (unsigned long)&value) == 0)
+			snprintf(buf, size, "%d", value);
+		break;
+
+	case PROFILE_TIMERSLACK:
+		value = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+		if (value >= 0)
+			snprintf(buf, size, "%d", value);
+		break;
+
+	case PROFILE_THP:
+		value = prctl(PR_GET_THP_DISABLE, 0, 0, 0, 0);
+		if (value >= 0)
+			snprintf(buf, size, "%s", value ? "off" : "on");
+		break;
+
+	case PROFILE_KSM:
+		value = prctl(PR_GET_MEMORY_MERGE, 0, 0, 0, 0);
+		if (value >= 0)
+			snprintf(buf, size, "%s", value ? "on" : "off");
+		break;
+
+	case PROFILE_SPEC:
+		value = prctl(PR_GET_SPECULATION_CTRL, item->arg, 0, 0, 0);
+		if (value == 0)
+			snprintf(buf, size, "not-affected");
+		for (i = 0; value > 0 && profile_words[i].name; i++)
+			if (value & profile_words[i].value)
+				snprintf(buf, size, "%s", profile_words[i].name);
+		break;
+
+	case PROFILE_AFFINITY:
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+			_format_cpulist(&set, buf, size);
+		break;
+
+	case PROFILE_SCHED:
+		value = sched_getscheduler(0) & ~SCHED_RESET_ON_FORK;
+		for (i = 0; value >= 0 && profile_policies[i].name; i++) {
+			if (profile_policies[i].policy != value)
+				continue;
+			if ((value == SCHED_FIFO || value == SCHED_RR) &&
+			    sched_getparam(0, &param) == 0)
+				snprintf(buf, size, "%s:%d",
+					 profile_policies[i].name,
+					 param.sched_priority);
+			else
+				snprintf(buf, size, "%s",
+					 profile_policies[i].name);
+		}
+		break;
+
+	case PROFILE_NICE:
+		errno = 0;
+		value = getpriority(PRIO_PROCESS, 0);
+		if (errno == 0)
+			snprintf(buf, size, "%d", value);
+		break;
+
+	case PROFILE_MLOCK:
+		snprintf(buf, size, "%ld kB locked", _status_kb("VmLck"));
+		break;
+
+	case PROFILE_RLIMIT:
+		if (getrlimit(item->arg, &limit) == 0) {
+			_format_rlimit(limit.rlim_cur, soft, sizeof(soft));
+			_format_rlimit(limit.rlim_max, hard, sizeof(hard));
+			snprintf(buf, size, "%s:%s", soft, hard);
+		}
+		break;
+	}
+}
+
+static int _profile_apply(struct profile_item *item)
+{
+	struct sched_param param;
+	struct rlimit limit;
+	int rc = 0;
+
+	switch (item->key) {
+	case PROFILE_NAME:
+		rc = prctl(PR_SET_NAME, (unsigned long)item->value, 0, 0, 0);
+		break;
+	case PROFILE_PDEATHSIG:
+		rc = prctl(PR_SET_PDEATHSIG, item->number[0], 0, 0, 0);
+		break;
+	case PROFILE_TIMERSLACK:
+		rc = prctl(PR_SET_TIMERSLACK, item->number[0], 0, 0, 0);
+		break;
+	case PROFILE_THP:
+		rc = prctl(PR_SET_THP_DISABLE, !item->number[0], 0, 0, 0);
+		break;
+	case PROFILE_KSM:
+		rc = prctl(PR_SET_MEMORY_MERGE, item->number[0], 0, 0, 0);
+		break;
+	case PROFILE_SPEC:
+		rc = prctl(PR_SET_SPECULATION_CTRL, item->arg, item->number[0],
+			   0, 0);
+		break;
+	case PROFILE_AFFINITY:
+		rc = sched_setaffinity(0, sizeof(item->cpus), &item->cpus);
+		break;
+	case PROFILE_SCHED:
+		param.sched_priority = item->number[1];
+		rc = sched_setscheduler(0, item->number[0], &param);
+		break;
+	case PROFILE_NICE:
+		rc = setpriority(PRIO_PROCESS, 0, item->number[0]);
+		break;
+	case PROFILE_MLOCK:
+		rc = mlockall(item->number[0]);
+		break;
+	case PROFILE_RLIMIT:
+		limit.rlim_cur = item->number[0];
+		limit.rlim_max = item->number[1];
+		rc = setrlimit(item->arg, &limit);
+		break;
+	}
+
+	return rc < 0 ? errno : 0;
+}
+
+static PyObject *py_apply_profile(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"profile", "dry_run", "strict", NULL};
+	struct profile_item *item, *failed = NULL;
+	char current[PROFILE_ITEMS][128];
+	PyObject *source = Py_None;
+	PyObject *result, *entry;
+	struct profile *profile;
+	int dry_run = 0, strict = 0;
+	const char *env;
+	int key, i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|Oii", kwlist, &source,
+					 &dry_run, &strict))
+		return NULL;
+
+	profile = PyMem_Malloc(sizeof(*profile));
+	if (!profile)
+		return PyErr_NoMemory();
+	profile->count = 0;
+
+	if (source == Py_None) {
+		env = getenv(PROFILE_ENV);
+		if (env && *env && _profile_source(profile, env) < 0)
+			goto error;
+	} else if (PyString_Check(source)) {
+		if (_profile_source(profile, PyString_AS_STRING(source)) < 0)
+			goto error;
+	} else if (PyDict_Check(source)) {
+		if (_profile_dict(profile, source) < 0)
+			goto error;
+	} else {
+		PyErr_SetString(PyExc_TypeError,
+				"profile must be a dict, a string or None");
+		goto error;
+	}
+
+	/* one pass over the parsed profile, in the order of the keys */
+	for (key = 0; key < PROFILE_KEYS; key++) {
+		for (i = 0; i < profile->count; i++) {
+			item = &profile->items[i];
+			if (item->key != key)
+				continue;
+
+			_profile_current(item, current[i], sizeof(current[i]));
+			if (!dry_run)
+				item->error = _profile_apply(item);
+			if (item->error && !failed)
+				failed = item;
+		}
+	}
+
+	if (strict && failed) {
+		errno = failed->error;
+		PyErr_SetFromErrnoWithFilename(ErrorObject, failed->setting);
+		goto error;
+	}
+
+	result = PyList_New(0);
+	if (!result)
+		goto error;
+
+	for (key = 0; key < PROFILE_KEYS; key++) {
+		for (i = 0; i < profile->count; i++) {
+			item = &profile->items[i];
+			if (item->key != key)
+				continue;
+
+			entry = PyStructSequence_New(&ProfileItemType);
+			if (!entry)
+				goto error_result;
+
+			PyStructSequence_SET_ITEM(entry, 0,
+				PyString_FromString(item->setting));
+			PyStructSequence_SET_ITEM(entry, 1,
+				PyString_FromString(current[i]));
+			PyStructSequence_SET_ITEM(entry, 2,
+				PyString_FromString(item->value));
+			if (item->error) {
+				PyStructSequence_SET_ITEM(entry, 3,
+					PyString_FromString(strerror(item->error)));
+			} else {
+				Py_INCREF(Py_None);
+				PyStructSequence_SET_ITEM(entry, 3, Py_None);
+			}
+
+			if (PyErr_Occurred() || PyList_Append(result, entry) < 0) {
+				Py_DECREF(entry);
+				goto error_result;
+			}
+			Py_DECREF(entry);
+		}
+	}
+
+	PyMem_Free(profile);
+	return result;
+
+error_result:
+	Py_DECREF(result);
+error:
+	PyMem_Free(profile);
+	return NULL;
+}
+
+static PyObject *py_profile_presets(PyObject *self, PyObject *noargs)
+{
+	PyObject *result, *text;
+	int i;
+
+	result = PyDict_New();
+	if (!result)
+		return NULL;
+
+	for (i = 0; profile_presets[i].name; i++) {
+		text = PyString_FromString(profile_presets[i].text);
+		if (!text ||
+		    PyDict_SetItemString(result, profile_presets[i].name,
+					 text) < 0) {
+			Py_XDECREF(text);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(text);
+	}
+
+	return result;
+}
+
+
+/*
+ * Adaptive timer slack.
+ *
+ * An AdaptiveSlack object follows the load of one thread, usually the
+ * one running an event loop, either as a count of requests in flight
+ * maintained by begin()/end() or as any figure passed to update(), such
+ * as loop utilisation. It gives the thread a tight slack once the load
+ * reaches high and a loose one after it stayed at or below low for hold
+ * seconds, so short dips do not flap between the two.
+ */
+typedef struct {
+	PyObject_HEAD
+	pid_t         tid;
+	int           tight;
+	long          inflight;
+	double        load;
+	double        high;
+	double        low;
+	long long     hold;         /* ns */
+	long long     below_since;  /* ns, 0 while above low */
+	unsigned long tight_ns;
+	unsigned long idle_ns;
+	unsigned long original;
+	unsigned long tightened;
+	unsigned long relaxed;
+} AdaptiveSlackObject;
+
+static PyTypeObject AdaptiveSlackType;
+
+static char adaptive_slack_doc[] =
+"AdaptiveSlack(tight=1000, idle=1000000, high=1, low=0, hold=0,\n\
+              thread=None) -> adaptive slack object\n\n\
+Switch the timer slack of thread, by default the calling one, between\n\
+tight ns while the load is at least high and idle ns once it stayed at\n\
+or below low for hold seconds. The load is the number of begin() calls\n\
+not yet matched by end(), or whatever was last passed to update(). The\n\
+object is also a context manager around begin() and end().\n\n\
+The hold time is only checked when begin(), end() or update() is\n\
+called; there is no timer, so a thread which goes idle stays tight\n\
+until something calls update() after hold seconds, for instance a\n\
+periodic callback of its event loop.\n\n\
+Threads other than the calling one are changed through\n\
+/proc/<tid>/timerslack_ns, which needs CAP_SYS_NICE.\n\
+";
+
+static int _set_timerslack(pid_t tid, unsigned long ns)
+{
+	char path[64], value[32];
+	int fd, len, rc;
+
+	if (tid == syscall(SYS_gettid))
+		return prctl(PR_SET_TIMERSLACK, ns, 0, 0, 0);
+
+	/* only the /proc/<pid> entries have it, not /proc/self/task */
+	_proc_path(path, sizeof(path), tid, 0, "timerslack_ns");
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	len = snprintf(value, sizeof(value), "%lu", ns);
+	rc = write(fd, value, len) == len ? 0 : -1;
+	close(fd);
+
+	return rc;
+}
+
+static long _get_timerslack(pid_t tid)
+{
+	char path[64], value[32];
+
+	if (tid == syscall(SYS_gettid))
+		return prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+
+	_proc_path(path, sizeof(path), tid, 0, "timerslack_ns");
+	if (_read_sysfs(path, value, sizeof(value)) < 0)
+		return -1;
+
+	return strtol(value, NULL, 10);
+}
+
+static int _adaptive_slack_eval(AdaptiveSlackObject *self)
+{
+	long long now;
+
+	if (self->load >= self->high) {
+		self->below_since = 0;
+		if (self->tight)
+			return 0;
+
+		if (_set_timerslack(self->tid, self->tight_ns) < 0)
+			goto error;
+		self->tight = 1;
+		self->tightened++;
+		return 0;
+	}
+
+	if (!self->tight || self->load > self->low) {
+		self->below_since = 0;
+		return 0;
+	}
+
+	now = _monotonic_ns();
+	if (!self->below_since)
+		self->below_since = now;
+	if (now - self->below_since < self->hold)
+		return 0;
+
+	if (_set_timerslack(self->tid, self->idle_ns) < 0)
+		goto error;
+	self->tight = 0;
+	self->relaxed++;
+	self->below_since = 0;
+	return 0;
+
+error:
+	PyErr_SetFromErrno(ErrorObject);
+	return -1;
+}
+
+static PyObject *AdaptiveSlack_new(PyTypeObject *type, PyObject *args,
+				   PyObject *kw)
+{
+	static char *kwlist[] = {"tight", "idle", "high", "low", "hold",
+				 "thread", NULL};
+	unsigned long tight = 1000, idle = 1000000;
+	double high = 1, low = 0, hold = 0;
+	AdaptiveSlackObject *self;
+	PyObject *thread = NULL;
+	long original;
+	pid_t tid;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|kkdddO:AdaptiveSlack",
+					 kwlist, &tight, &idle, &high, &low,
+					 &hold, &thread))
+		return NULL;
+
+	if (low >= high || hold < 0 || !tight || !idle) {
+		PyErr_SetString(PyExc_ValueError,
+				"need low < high, hold >= 0 and non-zero slack");
+		return NULL;
+	}
+
+	if (_resolve_tid(thread, &tid) < 0)
+		return NULL;
+	if (!tid)
+		tid = syscall(SYS_gettid);
+
+	original = _get_timerslack(tid);
+	if (original < 0 || _set_timerslack(tid, idle) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	self = (AdaptiveSlackObject *)type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+
+	self->tid      = tid;
+	self->high     = high;
+	self->low      = low;
+	self->hold     = hold * 1e9;
+	self->tight_ns = tight;
+	self->idle_ns  = idle;
+	self->original = original;
+
+	return (PyObject *)self;
+}
+
+static void AdaptiveSlack_dealloc(AdaptiveSlackObject *self)
+{
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *AdaptiveSlack_begin(AdaptiveSlackObject *self)
+{
+	self->load = ++self->inflight;
+	if (_adaptive_slack_eval(self) < 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *AdaptiveSlack_end(AdaptiveSlackObject *self)
+{
+	if (self->inflight <= 0) {
+		PyErr_SetString(PyExc_RuntimeError, "end() without begin()");
+		return NULL;
+	}
+
+	self->load = --self->inflight;
+	if (_adaptive_slack_eval(self) < 0)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *AdaptiveSlack_update(AdaptiveSlackObject *self,
+				      PyObject *args)
+{
+	PyObject *load = Py_None;
+
+	if (!PyArg_ParseTuple(args, "|O:update", &load))
+		return NULL;
+
+	if (load != Py_None) {
+		self->load = PyFloat_AsDouble(load);
+		if (self->load == -1.0 && PyErr_Occurred())
+			return NULL;
+	}
+
+	if (_adaptive_slack_eval(self) < 0)
+		return NULL;
+
+	return PyBool_FromLong(self->tight);
+}
+
+static PyObject *AdaptiveSlack_enter(AdaptiveSlackObject *self)
+{
+	if (!AdaptiveSlack_begin(self))
+		return NULL;
+	Py_DECREF(Py_None);
+
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+static PyObject *AdaptiveSlack_exit(AdaptiveSlackObject *self, PyObject *args)
+{
+	if (!AdaptiveSlack_end(self))
+		return NULL;
+	Py_DECREF(Py_None);
+
+	Py_INCREF(Py_False);
+	return Py_False;
+}
+
+static PyObject *AdaptiveSlack_close(AdaptiveSlackObject *self)
+{
+	if (_set_timerslack(self->tid, self->original) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	self->tight = 0;
+	self->below_since = 0;
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef AdaptiveSlack_methods[] = {
+	{"begin", (PyCFunction)AdaptiveSlack_begin, METH_NOARGS,
+	 "begin() -> None\n\nCount one more request in flight."},
+	{"end", (PyCFunction)AdaptiveSlack_end, METH_NOARGS,
+	 "end() -> None\n\nCount one request in flight less."},
+	{"update", (PyCFunction)AdaptiveSlack_update, METH_VARARGS,
+	 "update([load]) -> bool\n\n\
+Set the load, or only re-check the hold time, and return whether the\n\
+tight slack is in effect."},
+	{"close", (PyCFunction)AdaptiveSlack_close, METH_NOARGS,
+	 "close() -> None\n\nRestore the slack the thread had initially."},
+	{"__enter__", (PyCFunction)AdaptiveSlack_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)AdaptiveSlack_exit, METH_VARARGS, NULL},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef AdaptiveSlack_members[] = {
+	{"thread", T_INT, offsetof(AdaptiveSlackObject, tid), READONLY,
+	 "TID of the thread whose slack is managed"},
+	{"tight", T_INT, offsetof(AdaptiveSlackObject, tight), READONLY,
+	 "whether the tight slack is in effect"},
+	{"inflight", T_LONG, offsetof(AdaptiveSlackObject, inflight), READONLY,
+	 "begin() calls not yet matched by end()"},
+	{"load", T_DOUBLE, offsetof(AdaptiveSlackObject, load), READONLY,
+	 "current load"},
+	{"tightened", T_ULONG, offsetof(AdaptiveSlackObject, tightened),
+	 READONLY, "number of switches to the tight slack"},
+	{"relaxed", T_ULONG, offsetof(AdaptiveSlackObject, relaxed), READONLY,
+	 "number of switches to the idle slack"},
+	{NULL}
+};
+
+static PyTypeObject AdaptiveSlackType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"prctl.AdaptiveSlack",
+	sizeof(AdaptiveSlackObject),
+	0,
+	(destructor)AdaptiveSlack_dealloc,	/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	adaptive_slack_doc,			/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	AdaptiveSlack_methods,			/* tp_methods */
+	AdaptiveSlack_members,			/* tp_members */
+	0,					/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	0,					/* tp_init */
+	0,					/* tp_alloc */
+	AdaptiveSlack_new,			/* tp_new */
+};
+
+
+/*
+ * Precise sleeping.
+ *
+ * precise_sleep() sleeps with the minimal timer slack until shortly
+ * before an absolute CLOCK_MONOTONIC deadline and spins on the clock for
+ * the rest. The spin has to cover the thread's wakeup latency, so unless
+ * given it is taken once from a short wakeup_latency() style probe.
+ */
+#define SLEEP_PROBE_SAMPLES  200
+#define SLEEP_PROBE_INTERVAL 100000	/* ns */
+#define LATENCY_BUCKETS      20
+
+static long long _sleep_spin = -1;
+
+static PyTypeObject WakeupLatencyType;
+
+static PyStructSequence_Field wakeup_latency_fields[] = {
+	{"samples",    "number of wakeups measured"},
+	{"interval",   "requested sleep in ns"},
+	{"timerslack", "timer slack of the thread in ns"},
+	{"min",        "lowest wakeup latency in ns"},
+	{"avg",        "mean wakeup latency in ns"},
+	{"max",        "highest wakeup latency in ns"},
+	{"p50",        "median wakeup latency in ns"},
+	{"p99",        "99th percentile wakeup latency in ns"},
+	{"p999",       "99.9th percentile wakeup latency in ns"},
+	{"histogram",  "wakeups below 2**i us per bucket i, the last unbounded"},
+	{NULL}
+};
+
+static PyStructSequence_Desc wakeup_latency_desc = {
+	"prctl.WakeupLatency",
+	"Wakeup latencies of the calling thread",
+	wakeup_latency_fields,
+	10,
+};
+
+static char precise_sleep_doc[] =
+"precise_sleep(ns, spin=None) -> int\n\n\
+Sleep for ns nanoseconds, clock_nanosleep()ing with a timer slack of\n\
+1ns until spin ns before the deadline and busy waiting for the rest.\n\
+spin defaults to the p99 wakeup latency measured on first use. The\n\
+timer slack is restored afterwards. Returns by how many ns the deadline\n\
+was overshot.\n\
+";
+
+static char wakeup_latency_doc[] =
+"wakeup_latency(samples=1000, interval=0.001) -> WakeupLatency\n\n\
+Sleep samples times for interval seconds to an absolute deadline, as\n\
+cyclictest does, and record how late the calling thread woke up under\n\
+its current timer slack, scheduling policy and affinity.\n\
+";
+
+static int _ll_compare(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void _ns_timespec(long long ns, struct timespec *ts)
+{
+	ts->tv_sec  = ns / 1000000000LL;
+	ts->tv_nsec = ns % 1000000000LL;
+}
+
+/*
+ * Sleep until the absolute monotonic time deadline with the GIL
+ * released, running signal handlers whenever a signal cuts the sleep.
+ */
+static int _sleep_until(long long deadline)
+{
+	struct timespec ts;
+	int rc;
+
+	_ns_timespec(deadline, &ts);
+
+	for (;;) {
+		Py_BEGIN_ALLOW_THREADS
+		rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		Py_END_ALLOW_THREADS
+
+		if (rc != EINTR)
+			break;
+		if (PyErr_CheckSignals() < 0)
+			return -1;
+	}
+
+	if (rc) {
+		errno = rc;
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Fill latency with count wakeup latencies, each measured right after
+ * clock_nanosleep() returns and before the GIL is taken again.
+ */
+static int _wakeup_probe(long long interval, long long *latency, int count)
+{
+	struct timespec ts;
+	long long deadline;
+	int i, rc;
+
+	deadline = _monotonic_ns();
+
+	for (i = 0; i < count; i++) {
+		deadline += interval;
+		_ns_timespec(deadline, &ts);
+
+		Py_BEGIN_ALLOW_THREADS
+		do
+			rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					     &ts, NULL);
+		while (rc == EINTR);
+		latency[i] = _monotonic_ns() - deadline;
+		Py_END_ALLOW_THREADS
+
+		if (rc) {
+			errno = rc;
+			PyErr_SetFromErrno(ErrorObject);
+			return -1;
+		}
+		if (PyErr_CheckSignals() < 0)
+			return -1;
+
+		/* a late wakeup must not shorten the following sleeps */
+		if (latency[i] > interval)
+			deadline = _monotonic_ns();
+	}
+
+	return 0;
+}
+
+static long long _sleep_calibrate(void)
+{
+	long long latency[SLEEP_PROBE_SAMPLES];
+	long slack;
+
+	slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+	if (slack < 0 || prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	if (_wakeup_probe(SLEEP_PROBE_INTERVAL, latency,
+			  SLEEP_PROBE_SAMPLES) < 0) {
+		prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0);
+		return -1;
+	}
+
+	prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0);
+
+	qsort(latency, SLEEP_PROBE_SAMPLES, sizeof(long long), _ll_compare);
+	return latency[SLEEP_PROBE_SAMPLES * 99 / 100];
+}
+
+static PyObject *py_precise_sleep(PyObject *self, PyObject *args,
+				  PyObject *kw)
+{
+	static char *kwlist[] = {"ns", "spin", NULL};
+	long long ns, spin, deadline, now;
+	PyObject *spin_arg = Py_None;
+	long slack;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "L|O:precise_sleep", kwlist,
+					 &ns, &spin_arg))
+		return NULL;
+
+	if (spin_arg == Py_None) {
+		if (_sleep_spin < 0)
+			_sleep_spin = _sleep_calibrate();
+		if (_sleep_spin < 0)
+			return NULL;
+		spin = _sleep_spin;
+	} else {
+		spin = PyLong_AsLongLong(spin_arg);
+		if (spin == -1 && PyErr_Occurred())
+			return NULL;
+	}
+
+	if (ns < 0 || spin < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"ns and spin must not be negative");
+		return NULL;
+	}
+
+	deadline = _monotonic_ns() + ns;
+
+	slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+	if (slack < 0 ||
+	    (slack != 1 && prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0) < 0))
+		return PyErr_SetFromErrno(ErrorObject);
+
+	if (ns > spin && _sleep_until(deadline - spin) < 0) {
+		if (slack != 1)
+			prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0);
+		return NULL;
+	}
+
+	if (slack != 1)
+		prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0);
+
+	Py_BEGIN_ALLOW_THREADS
+	while ((now = _monotonic_ns()) < deadline)
+		;
+	Py_END_ALLOW_THREADS
+
+	return PyLong_FromLongLong(now - deadline);
+}
+
+static PyObject *py_wakeup_latency(PyObject *self, PyObject *args,
+				   PyObject *kw)
+{
+	static char *kwlist[] = {"samples", "interval", NULL};
+	long long *latency, sum = 0, interval;
+	long buckets[LATENCY_BUCKETS] = {0};
+	PyObject *result, *histogram;
+	double seconds = 0.001;
+	int samples = 1000;
+	long slack;
+	int i, b;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|id:wakeup_latency",
+					 kwlist, &samples, &seconds))
+		return NULL;
+
+	if (samples <= 0 || seconds <= 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"samples and interval must be positive");
+		return NULL;
+	}
+
+	slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+	if (slack < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	latency = PyMem_New(long long, samples);
+	if (!latency)
+		return PyErr_NoMemory();
+
+	interval = seconds * 1e9;
+	if (_wakeup_probe(interval, latency, samples) < 0) {
+		PyMem_Free(latency);
+		return NULL;
+	}
+
+	for (i = 0; i < samples; i++) {
+		sum += latency[i];
+		for (b = 0; b < LATENCY_BUCKETS - 1; b++)
+			if (latency[i] < 1000LL << b)
+				break;
+		buckets[b]++;
+	}
+
+	qsort(latency, samples, sizeof(long long), _ll_compare);
+
+	histogram = PyTuple_New(LATENCY_BUCKETS);
+	if (!histogram) {
+		PyMem_Free(latency);
+		return NULL;
+	}
+	for (b = 0; b < LATENCY_BUCKETS; b++)
+		PyTuple_SET_ITEM(histogram, b, PyInt_FromLong(buckets[b]));
+
+	result = PyStructSequence_New(&WakeupLatencyType);
+	if (!result) {
+		Py_DECREF(histogram);
+		PyMem_Free(latency);
+		return NULL;
+	}
+
+	PyStructSequence_SET_ITEM(result, 0, PyInt_FromLong(samples));
+	PyStructSequence_SET_ITEM(result, 1, PyLong_FromLongLong(interval));
+	PyStructSequence_SET_ITEM(result, 2, PyInt_FromLong(slack));
+	PyStructSequence_SET_ITEM(result, 3, PyLong_FromLongLong(latency[0]));
+	PyStructSequence_SET_ITEM(result, 4,
+				  PyLong_FromLongLong(sum / samples));
+	PyStructSequence_SET_ITEM(result, 5,
+				  PyLong_FromLongLong(latency[samples - 1]));
+	PyStructSequence_SET_ITEM(result, 6,
+				  PyLong_FromLongLong(latency[samples / 2]));
+	PyStructSequence_SET_ITEM(result, 7,
+		PyLong_FromLongLong(latency[(long long)samples * 99 / 100]));
+	PyStructSequence_SET_ITEM(result, 8,
+		PyLong_FromLongLong(latency[(long long)samples * 999 / 1000]));
+	PyStructSequence_SET_ITEM(result, 9, histogram);
+
+	PyMem_Free(latency);
+	return result;
+}
+
+
+/*
+ * Pressure stall information.
+ *
+ * A PressureMonitor owns an epoll descriptor holding PSI triggers, each
+ * an open /proc/pressure/<resource> or <cgroup>/<resource>.pressure file
+ * into which "<some|full> <stall us> <window us>" was written. The kernel
+ * signals a trigger with EPOLLPRI at most once per window, so the outer
+ * descriptor can sit in a selector or event loop next to everything
+ * else and wait() tells which triggers fired.
+ */
+#define PROC_PRESSURE "/proc/pressure"
+#define PRESSURE_BATCH 32
+
+typedef struct {
+	PyObject_HEAD
+	int       epfd;
+	PyObject *triggers; /* fd -> label */
+} PressureMonitorObject;
+
+static PyTypeObject PressureMonitorType;
+static PyTypeObject PressureType;
+
+static PyStructSequence_Field pressure_fields[] = {
+	{"some_avg10",  "% of time some tasks stalled, 10s average"},
+	{"some_avg60",  "% of time some tasks stalled, 60s average"},
+	{"some_avg300", "% of time some tasks stalled, 300s average"},
+	{"some_total",  "total time some tasks stalled in us"},
+	{"full_avg10",  "% of time all tasks stalled, 10s average"},
+	{"full_avg60",  "% of time all tasks stalled, 60s average"},
+	{"full_avg300", "% of time all tasks stalled, 300s average"},
+	{"full_total",  "total time all tasks stalled in us"},
+	{NULL}
+};
+
+static PyStructSequence_Desc pressure_desc = {
+	"prctl.Pressure",
+	"Pressure stall averages of one resource, full_* None if not reported",
+	pressure_fields,
+	8,
+};
+
+static char pressure_monitor_doc[] =
+"PressureMonitor() -> pressure monitor object\n\n\
+Register PSI triggers and wait for them to fire. The object's fileno()\n\
+becomes readable whenever a trigger fires and may be handed to select,\n\
+epoll or an event loop.\n\
+";
+
+static char pressure_doc[] =
+"pressure(resource, cgroup=None) -> Pressure\n\n\
+Return the stall averages of resource ('cpu', 'memory', 'io' or 'irq')\n\
+for the system, or for the cgroup v2 directory cgroup.\n\
+";
+
+static int _pressure_path(char *path, size_t len, const char *resource,
+			  const char *cgroup)
+{
+	if (!*resource || strchr(resource, '/') || resource[0] == '.') {
+		PyErr_Format(PyExc_ValueError, "invalid resource '%s'",
+			     resource);
+		return -1;
+	}
+
+	if (cgroup)
+		snprintf(path, len, "%s/%s.pressure", cgroup, resource);
+	else
+		snprintf(path, len, PROC_PRESSURE "/%s", resource);
+
+	return 0;
+}
+
+static PyObject *PressureMonitor_new(PyTypeObject *type, PyObject *args,
+				     PyObject *kw)
+{
+	PressureMonitorObject *self;
+
+	if (!PyArg_ParseTuple(args, ":PressureMonitor"))
+		return NULL;
+
+	self = (PressureMonitorObject *)type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+	self->epfd = -1;
+
+	self->triggers = PyDict_New();
+	if (!self->triggers) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	self->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (self->epfd < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+static void _pressure_monitor_close(PressureMonitorObject *self)
+{
+	PyObject *key, *value;
+	Py_ssize_t pos = 0;
+
+	if (self->triggers) {
+		while (PyDict_Next(self->triggers, &pos, &key, &value))
+			close(PyInt_AsLong(key));
+		PyDict_Clear(self->triggers);
+	}
+
+	if (self->epfd >= 0)
+		close(self->epfd);
+	self->epfd = -1;
+}
+
+static void PressureMonitor_dealloc(PressureMonitorObject *self)
+{
+	_pressure_monitor_close(self);
+	Py_XDECREF(self->triggers);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *PressureMonitor_add(PressureMonitorObject *self,
+				     PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"resource", "stall", "window", "full",
+				 "cgroup", "label", NULL};
+	char path[PATH_MAX], trigger[64];
+	struct epoll_event event;
+	PyObject *resource_arg, *label = NULL, *key;
+	const char *resource, *cgroup = NULL;
+	double stall, window = 1.0;
+	int full = 0;
+	int fd, len;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "Od|dizO:add", kwlist,
+					 &resource_arg, &stall, &window, &full,
+					 &cgroup, &label))
+		return NULL;
+
+	resource = PyString_AsString(resource_arg);
+	if (!resource)
+		return NULL;
+
+	if (self->epfd < 0) {
+		PyErr_SetString(PyExc_ValueError, "monitor is closed");
+		return NULL;
+	}
+
+	if (stall <= 0 || window < stall) {
+		PyErr_SetString(PyExc_ValueError,
+				"need 0 < stall <= window");
+		return NULL;
+	}
+
+	if (_pressure_path(path, sizeof(path), resource, cgroup) < 0)
+		return NULL;
+
+	fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return PyErr_SetFromErrnoWithFilename(ErrorObject, path);
+
+	/* the kernel takes the terminating NUL as part of the trigger */
+	len = snprintf(trigger, sizeof(trigger), "%s %lld %lld",
+		       full ? "full" : "some", (long long)(stall * 1e6),
+		       (long long)(window * 1e6)) + 1;
+	if (write(fd, trigger, len) < 0) {
+		PyErr_SetFromErrnoWithFilename(ErrorObject, path);
+		close(fd);
+		return NULL;
+	}
+
+	event.events  = EPOLLPRI;
+	event.data.fd = fd;
+
+	if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		close(fd);
+		return NULL;
+	}
+
+	key = PyInt_FromLong(fd);
+	if (!label)
+		label = resource_arg;
+	if (!key || PyDict_SetItem(self->triggers, key, label) < 0) {
+		Py_XDECREF(key);
+		close(fd);
+		return NULL;
+	}
+
+	return key;
+}
+
+static PyObject *PressureMonitor_remove(PressureMonitorObject *self,
+					PyObject *args)
+{
+	PyObject *key;
+	int fd;
+
+	if (!PyArg_ParseTuple(args, "i:remove", &fd))
+		return NULL;
+
+	key = PyTuple_GET_ITEM(args, 0);
+	if (!PyDict_GetItem(self->triggers, key)) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	epoll_ctl(self->epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	if (PyDict_DelItem(self->triggers, key) < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *PressureMonitor_wait(PressureMonitorObject *self,
+				      PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"timeout", NULL};
+	struct epoll_event events[PRESSURE_BATCH];
+	PyObject *result, *key, *label;
+	double timeout = 0.0;
+	int rc;
+	int i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|d:wait", kwlist,
+					 &timeout))
+		return NULL;
+
+	if (self->epfd < 0) {
+		PyErr_SetString(PyExc_ValueError, "monitor is closed");
+		return NULL;
+	}
+
+	rc = _epoll_wait_signals(self->epfd, events, PRESSURE_BATCH,
+				 timeout);
+	if (rc < 0)
+		return NULL;
+
+	result = PyList_New(0);
+	if (!result)
+		return NULL;
+
+	for (i = 0; i < rc; i++) {
+		key = PyInt_FromLong(events[i].data.fd);
+		if (!key)
+			goto error;
+
+		label = PyDict_GetItem(self->triggers, key);
+		Py_DECREF(key);
+
+		/* EPOLLERR: the cgroup of the trigger went away */
+		if (label && PyList_Append(result, label) < 0)
+			goto error;
+	}
+
+	return result;
+error:
+	Py_DECREF(result);
+	return NULL;
+}
+
+static PyObject *PressureMonitor_fileno(PressureMonitorObject *self)
+{
+	return PyInt_FromLong(self->epfd);
+}
+
+static PyObject *PressureMonitor_close(PressureMonitorObject *self)
+{
+	_pressure_monitor_close(self);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static Py_ssize_t PressureMonitor_length(PressureMonitorObject *self)
+{
+	return PyDict_Size(self->triggers);
+}
+
+static PyMethodDef PressureMonitor_methods[] = {
+	{"add", (PyCFunction)PressureMonitor_add, METH_VARARGS | METH_KEYWORDS,
+	 "add(resource, stall, window=1.0, full=False, cgroup=None,\n\
+    label=resource) -> int\n\n\
+Fire when tasks stalled on resource for stall seconds within window\n\
+seconds, counting time in which all tasks rather than some stalled if\n\
+full is set. window must lie between 0.5 and 10 seconds and, without\n\
+CAP_SYS_RESOURCE, be a multiple of 2 seconds. With cgroup, watch that\n\
+cgroup v2 directory instead of the system. wait() reports the trigger\n\
+by label; the returned trigger descriptor identifies it to remove()."},
+	{"remove", (PyCFunction)PressureMonitor_remove, METH_VARARGS,
+	 "remove(trigger) -> None\n\nUnregister and close trigger."},
+	{"wait", (PyCFunction)PressureMonitor_wait,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "wait(timeout=0.0) -> [label, ...]\n\n\
+Wait up to timeout seconds (forever if negative) for triggers to fire\n\
+and return the labels of those that did."},
+	{"fileno", (PyCFunction)PressureMonitor_fileno, METH_NOARGS,
+	 "fileno() -> int\n\nThe pollable epoll descriptor."},
+	{"close", (PyCFunction)PressureMonitor_close, METH_NOARGS,
+	 "close() -> None\n\nClose the epoll descriptor and all triggers."},
+	{NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods PressureMonitor_as_sequence = {
+	(lenfunc)PressureMonitor_length,
+};
+
+static PyTypeObject PressureMonitorType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"prctl.PressureMonitor",
+	sizeof(PressureMonitorObject),
+	0,
+	(destructor)PressureMonitor_dealloc,	/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	&PressureMonitor_as_sequence,		/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	pressure_monitor_doc,			/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	PressureMonitor_methods,		/* tp_methods */
+	0,					/* tp_members */
+	0,					/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	0,					/* tp_init */
+	0,					/* tp_alloc */
+	PressureMonitor_new,			/* tp_new */
+};
+
+static PyObject *py_pressure(PyObject *self, PyObject *args)
+{
+	char path[PATH_MAX], buf[256], kind[8];
+	const char *resource, *cgroup = NULL;
+	double avg10, avg60, avg300;
+	unsigned long long total;
+	PyObject *result;
+	char *line;
+	int i, base;
+
+	if (!PyArg_ParseTuple(args, "s|z:pressure", &resource, &cgroup))
+		return NULL;
+
+	if (_pressure_path(path, sizeof(path), resource, cgroup) < 0)
+		return NULL;
+
+	if (_read_sysfs(path, buf, sizeof(buf)) < 0)
+		return PyErr_SetFromErrnoWithFilename(ErrorObject, path);
+
+	result = PyStructSequence_New(&PressureType);
+	if (!result)
+		return NULL;
+
+	for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+		if (sscanf(line, "%7s avg10=%lf avg60=%lf avg300=%lf total=%llu",
+			   kind, &avg10, &avg60, &avg300, &total) != 5)
+			continue;
+
+		if (!strcmp(kind, "some"))
+			base = 0;
+		else if (!strcmp(kind, "full"))
+			base = 4;
+		else
+			continue;
+
+		PyStructSequence_SET_ITEM(result, base,
+					  PyFloat_FromDouble(avg10));
+		PyStructSequence_SET_ITEM(result, base + 1,
+					  PyFloat_FromDouble(avg60));
+		PyStructSequence_SET_ITEM(result, base + 2,
+					  PyFloat_FromDouble(avg300));
+		PyStructSequence_SET_ITEM(result, base + 3,
+					  PyLong_FromUnsignedLongLong(total));
+	}
+
+	for (i = 0; i < 8; i++) {
+		if (!PyTuple_GET_ITEM(result, i)) {
+			Py_INCREF(Py_None);
+			PyStructSequence_SET_ITEM(result, i, Py_None);
+		}
+	}
+
+	if (PyErr_Occurred()) {
+		Py_DECREF(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+
+/*
+ * I/O priorities.
+ *
+ * ioprio_set(2) is per thread and has no glibc wrapper. A priority is a
+ * class and a level within it packed into one int; threads of class
+ * NONE derive theirs from the nice value.
+ */
+static char ioprio_get_doc[] =
+"ioprio_get(thread=None) -> (ioclass, level)\n\n\
+Return the I/O priority of thread, by default the calling one. thread\n\
+is a TID or a threading.Thread.\n\
+";
+
+static char ioprio_set_doc[] =
+"ioprio_set(ioclass, level=None, thread=None) -> None\n\n\
+Set the I/O priority of thread, by default the calling one, to ioclass\n\
+(IOPRIO_CLASS_RT, _BE, _IDLE or _NONE) and level 0-7, lower levels\n\
+being served first. level defaults to 4 for RT and BE.\n\
+";
+
+static char process_ioprio_set_doc[] =
+"process_ioprio_set(ioclass, level=None, pid=0) -> int\n\n\
+Set the I/O priority of every thread of process pid as ioprio_set()\n\
+does and return the number of threads changed.\n\
+";
+
+static char ioprio_scope_doc[] =
+"ioprio_scope(ioclass, level=None, thread=None) -> context manager\n\n\
+Set the I/O priority of thread on entry and restore the previous one on\n\
+exit. Entering returns the (ioclass, level) in effect.\n\
+";
+
+static int _ioprio_value(int ioclass, PyObject *level)
+{
+	long value;
+
+	if (ioclass < IOPRIO_CLASS_NONE || ioclass > IOPRIO_CLASS_IDLE) {
+		PyErr_SetString(PyExc_ValueError, "invalid I/O priority class");
+		return -1;
+	}
+
+	if (!level || level == Py_None)
+		value = ioclass == IOPRIO_CLASS_RT ||
+			ioclass == IOPRIO_CLASS_BE ? 4 : 0;
+	else {
+		value = PyInt_AsLong(level);
+		if (value == -1 && PyErr_Occurred())
+			return -1;
+	}
+
+	if (value < 0 || value > 7) {
+		PyErr_SetString(PyExc_ValueError,
+				"I/O priority level must be 0-7");
+		return -1;
+	}
+
+	return IOPRIO_PRIO_VALUE(ioclass, value);
+}
+
+static PyObject *_ioprio_tuple(int ioprio)
+{
+	return Py_BuildValue("(ii)", IOPRIO_PRIO_CLASS(ioprio),
+			     IOPRIO_PRIO_DATA(ioprio));
+}
+
+static PyObject *py_ioprio_get(PyObject *self, PyObject *args)
+{
+	PyObject *thread = NULL;
+	pid_t tid;
+	int ioprio;
+
+	if (!PyArg_ParseTuple(args, "|O:ioprio_get", &thread))
+		return NULL;
+
+	if (_resolve_tid(thread, &tid) < 0)
+		return NULL;
+
+	ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid);
+	if (ioprio < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	return _ioprio_tuple(ioprio);
+}
+
+static PyObject *py_ioprio_set(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"ioclass", "level", "thread", NULL};
+	PyObject *level = NULL, *thread = NULL;
+	int ioclass, ioprio;
+	pid_t tid;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "i|OO:ioprio_set", kwlist,
+					 &ioclass, &level, &thread))
+		return NULL;
+
+	ioprio = _ioprio_value(ioclass, level);
+	if (ioprio < 0 || _resolve_tid(thread, &tid) < 0)
+		return NULL;
+
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio) < 0)
+		return PyErr_SetFromErrno(ErrorObject);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *py_process_ioprio_set(PyObject *self, PyObject *args,
+				       PyObject *kw)
+{
+	static char *kwlist[] = {"ioclass", "level", "pid", NULL};
+	PyObject *level = NULL;
+	struct dirent *entry;
+	int ioclass, ioprio;
+	int count = 0;
+	char path[64];
+	int pid = 0;
+	DIR *dir;
+	pid_t tid;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "i|Oi:process_ioprio_set",
+					 kwlist, &ioclass, &level, &pid))
+		return NULL;
+
+	ioprio = _ioprio_value(ioclass, level);
+	if (ioprio < 0)
+		return NULL;
+
+	_proc_path(path, sizeof(path), pid, 0, "task");
+	dir = opendir(path);
+	if (!dir)
+		return PyErr_SetFromErrnoWithFilename(ErrorObject, path);
+
+	while ((entry = readdir(dir))) {
+		tid = atoi(entry->d_name);
+		if (tid <= 0)
+			continue;
+
+		if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+			    ioprio) < 0) {
+			/* the thread exited since readdir() */
+			if (errno == ESRCH)
+				continue;
+			PyErr_SetFromErrno(ErrorObject);
+			closedir(dir);
+			return NULL;
+		}
+		count++;
+	}
+
+	closedir(dir);
+	return PyInt_FromLong(count);
+}
+
+static int _ioprio_scope_enter(ScopeObject *self)
+{
+	int ioprio;
+
+	ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, self->target);
+	if (ioprio < 0)
+		goto error;
+	self->state[0] = ioprio;
+
+	ioprio = _ioprio_value(self->state[1],
+			       PyDict_GetItemString(self->kw, "level"));
+	if (ioprio < 0)
+		return -1;
+
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, self->target,
+		    ioprio) < 0)
+		goto error;
+
+	self->value = _ioprio_tuple(ioprio);
+	return self->value ? 0 : -1;
+error:
+	PyErr_SetFromErrno(ErrorObject);
+	return -1;
+}
+
+static int _ioprio_scope_exit(ScopeObject *self)
+{
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, self->target,
+		    (int)self->state[0]) < 0) {
+		PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct scope_ops ioprio_scope_ops = {
+	_ioprio_scope_enter,
+	_ioprio_scope_exit,
+};
+
+static PyObject *py_ioprio_scope(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"ioclass", "level", "thread", NULL};
+	PyObject *level = Py_None, *thread = NULL, *scope_kw;
+	ScopeObject *scope;
+	int ioclass;
+	pid_t tid;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "i|OO:ioprio_scope", kwlist,
+					 &ioclass, &level, &thread))
+		return NULL;
+
+	if (_ioprio_value(ioclass, level) < 0 || _resolve_tid(thread, &tid) < 0)
+		return NULL;
+
+	/* a scope entered from another thread must still hit this one */
+	if (!tid)
+		tid = syscall(SYS_gettid);
+
+	scope_kw = Py_BuildValue("{sO}", "level", level);
+	if (!scope_kw)
+		return NULL;
+
+	scope = (ScopeObject *)_scope_new(&ioprio_scope_ops, tid, scope_kw);
+	Py_DECREF(scope_kw);
+	if (scope)
+		scope->state[1] = ioclass;
+
+	return (PyObject *)scope;
+}
+
+
+/*
+ * Profiler attach under Yama.
+ *
+ * With kernel.yama.ptrace_scope at 1 only ancestors may attach, unless
+ * the process names a tracer with PR_SET_PTRACER. The setting cannot be
+ * read back, so the calls here only ever grant and clear it. A timed
+ * grant is revoked by a detached thread which lives until its deadline.
+ */
+#define YAMA_PTRACE_SCOPE "/proc/sys/kernel/yama/ptrace_scope"
+#define PTRACER_ANY -1
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  wake;
+	int             running;
+	int             pending;
+	struct timespec deadline;
+} _ptracer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+static char set_ptracer_doc[] =
+"set_ptracer(pid) -> None\n\n\
+Allow process pid, and its descendants, to ptrace this process under\n\
+Yama. PTRACER_ANY allows every process, 0 withdraws the permission.\n\
+Cancels a pending allow_ptrace() revocation.\n\
+";
+
+static char allow_ptrace_doc[] =
+"allow_ptrace(pid=PTRACER_ANY, seconds=60.0) -> None\n\n\
+Allow pid to ptrace this process, as set_ptracer() does, for seconds\n\
+only. The permission is withdrawn from a background thread afterwards;\n\
+a tracer already attached stays attached. A later call replaces the\n\
+grant and its deadline.\n\
+";
+
+static char ptracer_scope_doc[] =
+"ptracer_scope(pid=PTRACER_ANY) -> context manager\n\n\
+Allow pid to ptrace this process within the block and withdraw the\n\
+permission on exit.\n\
+";
+
+static char yama_ptrace_scope_doc[] =
+"yama_ptrace_scope() -> int or None\n\n\
+Return kernel.yama.ptrace_scope, None when Yama is not active. At 0\n\
+any process of the same user may attach and at 1 only ancestors and\n\
+the tracer named here; at 2 and 3 set_ptracer() has no effect.\n\
+";
+
+static int _set_ptracer(long pid)
+{
+	unsigned long arg = pid == PTRACER_ANY ? PR_SET_PTRACER_ANY : pid;
+
+	if (prctl(PR_SET_PTRACER, arg, 0, 0, 0) < 0) {
+		/* EINVAL alone does not say that Yama is missing */
+		if (errno == EINVAL && access(YAMA_PTRACE_SCOPE, F_OK) < 0) {
+			PyObject *args;
+
+			args = Py_BuildValue("(is)", EINVAL,
+					     "PR_SET_PTRACER needs the Yama LSM");
+			if (args) {
+				PyErr_SetObject(ErrorObject, args);
+				Py_DECREF(args);
+			}
+		} else
+			PyErr_SetFromErrno(ErrorObject);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void _ptracer_cancel(void)
+{
+	pthread_mutex_lock(&_ptracer.lock);
+	_ptracer.pending = 0;
+	pthread_cond_signal(&_ptracer.wake);
+	pthread_mutex_unlock(&_ptracer.lock);
+}
+
+static void *_ptracer_main(void *arg)
+{
+	struct timespec now;
+
+	pthread_mutex_lock(&_ptracer.lock);
+
+	while (_ptracer.pending) {
+		pthread_cond_timedwait(&_ptracer.wake, &_ptracer.lock,
+				       &_ptracer.deadline);
+		if (!_ptracer.pending)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > _ptracer.deadline.tv_sec ||
+		    (now.tv_sec == _ptracer.deadline.tv_sec &&
+		     now.tv_nsec >= _ptracer.deadline.tv_nsec)) {
+			prctl(PR_SET_PTRACER, 0, 0, 0, 0);
+			_ptracer.pending = 0;
+		}
+	}
+
+	_ptracer.running = 0;
+	pthread_mutex_unlock(&_ptracer.lock);
+	return NULL;
+}
+
+/* The deadline is on CLOCK_MONOTONIC so that clock steps do not move it. */
+static void _ptracer_cond_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&_ptracer.wake, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void _ptracer_atfork_child(void)
+{
+	/* neither the thread nor the grant survive fork */
+	pthread_mutex_init(&_ptracer.lock, NULL);
+	_ptracer_cond_init();
+	_ptracer.running = 0;
+	_ptracer.pending = 0;
+}
+
+static PyObject *py_set_ptracer(PyObject *self, PyObject *args)
+{
+	long pid;
+
+	if (!PyArg_ParseTuple(args, "l:set_ptracer", &pid))
+		return NULL;
+
+	_ptracer_cancel();
+	if (_set_ptracer(pid) < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *py_allow_ptrace(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"pid", "seconds", NULL};
+	static int atfork;
+	double seconds = 60.0;
+	long pid = PTRACER_ANY;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int error = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|ld:allow_ptrace", kwlist,
+					 &pid, &seconds))
+		return NULL;
+
+	if (seconds <= 0) {
+		PyErr_SetString(PyExc_ValueError, "seconds must be positive");
+		return NULL;
+	}
+
+	/* no revocation thread can be waiting on the cond before this */
+	if (!atfork) {
+		_ptracer_cond_init();
+		pthread_atfork(NULL, NULL, _ptracer_atfork_child);
+		atfork = 1;
+	}
+
+	/*
+	 * Held across the prctl, so that an expiring grant cannot be
+	 * revoked by the thread between setting the new one and pushing
+	 * the deadline out.
+	 */
+	pthread_mutex_lock(&_ptracer.lock);
+
+	if (_set_ptracer(pid) < 0) {
+		pthread_mutex_unlock(&_ptracer.lock);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &_ptracer.deadline);
+	_ptracer.deadline.tv_sec  += (time_t)seconds;
+	_ptracer.deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+	if (_ptracer.deadline.tv_nsec >= 1000000000) {
+		_ptracer.deadline.tv_sec++;
+		_ptracer.deadline.tv_nsec -= 1000000000;
+	}
+	_ptracer.pending = 1;
+
+	if (_ptracer.running)
+		pthread_cond_signal(&_ptracer.wake);
+	else {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		error = pthread_create(&thread, &attr, _ptracer_main, NULL);
+		pthread_attr_destroy(&attr);
+		if (error)
+			_ptracer.pending = 0;
+		else
+			_ptracer.running = 1;
+	}
+
+	pthread_mutex_unlock(&_ptracer.lock);
+
+	if (error) {
+		prctl(PR_SET_PTRACER, 0, 0, 0, 0);
+		errno = error;
+		return PyErr_SetFromErrno(ErrorObject);
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static int _ptracer_scope_enter(ScopeObject *self)
+{
+	_ptracer_cancel();
+	return _set_ptracer(self->state[0]);
+}
+
+static int _ptracer_scope_exit(ScopeObject *self)
+{
+	return _set_ptracer(0);
+}
+
+static struct scope_ops ptracer_scope_ops = {
+	_ptracer_scope_enter,
+	_ptracer_scope_exit,
+};
+
+static PyObject *py_ptracer_scope(PyObject *self, PyObject *args,
+				  PyObject *kw)
+{
+	static char *kwlist[] = {"pid", NULL};
+	long pid = PTRACER_ANY;
+	ScopeObject *scope;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "|l:ptracer_scope", kwlist,
+					 &pid))
+		return NULL;
+
+	scope = (ScopeObject *)_scope_new(&ptracer_scope_ops, 0, NULL);
+	if (scope)
+		scope->state[0] = pid;
+
+	return (PyObject *)scope;
+}
+
+static PyObject *py_yama_ptrace_scope(PyObject *self)
+{
+	char buf[16];
+
+	if (_read_sysfs(YAMA_PTRACE_SCOPE, buf, sizeof(buf)) < 0) {
+		if (errno == ENOENT)
+			Py_RETURN_NONE;
+		return PyErr_SetFromErrnoWithFilename(ErrorObject,
+						      YAMA_PTRACE_SCOPE);
+	}
+
+	return PyInt_FromLong(atoi(buf));
+}
+
+
+static PyMethodDef _prctl_methods[] = {
+	{"prctl", py_prctl, METH_VARARGS, prctl_doc},
+	{"zygote_serve", py_zygote_serve, METH_VARARGS, zygote_serve_doc},
+	{"zygote_spawn", (PyCFunction)py_zygote_spawn,
+	 METH_VARARGS | METH_KEYWORDS, zygote_spawn_doc},
+	{"gettid", (PyCFunction)_gettid, METH_NOARGS, gettid_doc},
+	{"sched_getattr", py_sched_getattr, METH_VARARGS, sched_getattr_doc},
+	{"sched_setattr", (PyCFunction)py_sched_setattr,
+	 METH_VARARGS | METH_KEYWORDS, sched_setattr_doc},
+	{"sched_scope", (PyCFunction)py_sched_scope,
+	 METH_VARARGS | METH_KEYWORDS, sched_scope_doc},
+	{"cpu_topology", (PyCFunction)py_cpu_topology,
+	 METH_VARARGS | METH_KEYWORDS, cpu_topology_doc},
+	{"place_worker", (PyCFunction)py_place_worker,
+	 METH_VARARGS | METH_KEYWORDS, place_worker_doc},
+	{"pin_worker", (PyCFunction)py_pin_worker,
+	 METH_VARARGS | METH_KEYWORDS, pin_worker_doc},
+	{"set_affinity", py_set_affinity, METH_VARARGS, set_affinity_doc},
+	{"get_affinity", py_get_affinity, METH_VARARGS, get_affinity_doc},
+	{"set_mempolicy", (PyCFunction)py_set_mempolicy,
+	 METH_VARARGS | METH_KEYWORDS, set_mempolicy_doc},
+	{"get_mempolicy", (PyCFunction)py_get_mempolicy, METH_NOARGS,
+	 get_mempolicy_doc},
+	{"mbind", (PyCFunction)py_mbind, METH_VARARGS | METH_KEYWORDS, mbind_doc},
+	{"page_nodes", py_page_nodes, METH_VARARGS, page_nodes_doc},
+	{"alloc_buffer", (PyCFunction)py_alloc_buffer,
+	 METH_VARARGS | METH_KEYWORDS, alloc_buffer_doc},
+	{"hugepage_heap", (PyCFunction)py_hugepage_heap,
+	 METH_VARARGS | METH_KEYWORDS, hugepage_heap_doc},
+	{"hugify_text", (PyCFunction)py_hugify_text,
+	 METH_VARARGS | METH_KEYWORDS, hugify_text_doc},
+	{"mlockall", py_mlockall, METH_VARARGS, mlockall_doc},
+	{"munlockall", (PyCFunction)py_munlockall, METH_NOARGS, munlockall_doc},
+	{"mlock_scope", (PyCFunction)py_mlock_scope,
+	 METH_VARARGS | METH_KEYWORDS, mlock_scope_doc},
+	{"prefault", (PyCFunction)py_prefault, METH_VARARGS | METH_KEYWORDS,
+	 prefault_doc},
+	{"locked_memory", (PyCFunction)py_locked_memory, METH_NOARGS,
+	 locked_memory_doc},
+	{"page_faults", (PyCFunction)py_page_faults,
+	 METH_VARARGS | METH_KEYWORDS, page_faults_doc},
+	{"pidfd_open", py_pidfd_open, METH_VARARGS, pidfd_open_doc},
+	{"madvise", py_madvise, METH_VARARGS, madvise_doc},
+	{"process_madvise", (PyCFunction)py_process_madvise,
+	 METH_VARARGS | METH_KEYWORDS, process_madvise_doc},
+	{"get_coredump_filter", py_get_coredump_filter, METH_VARARGS,
+	 get_coredump_filter_doc},
+	{"set_coredump_filter", py_set_coredump_filter, METH_VARARGS,
+	 set_coredump_filter_doc},
+	{"dont_dump", py_dont_dump, METH_VARARGS, dont_dump_doc},
+	{"do_dump", py_do_dump, METH_VARARGS, do_dump_doc},
+	{"core_size", py_core_size, METH_VARARGS, core_size_doc},
+	{"mallopt", py_mallopt, METH_VARARGS, mallopt_doc},
+	{"malloc_trim", (PyCFunction)py_malloc_trim,
+	 METH_VARARGS | METH_KEYWORDS, malloc_trim_doc},
+	{"malloc_info", (PyCFunction)py_malloc_info, METH_NOARGS,
+	 malloc_info_doc},
+	{"start_trimmer", (PyCFunction)py_start_trimmer,
+	 METH_VARARGS | METH_KEYWORDS, start_trimmer_doc},
+	{"stop_trimmer", (PyCFunction)py_stop_trimmer, METH_NOARGS,
+	 stop_trimmer_doc},
+	{"proc_stat", py_proc_stat, METH_VARARGS, proc_stat_doc},
+	{"proc_status", py_proc_status, METH_VARARGS, proc_status_doc},
+	{"smaps_rollup", py_smaps_rollup, METH_VARARGS, smaps_rollup_doc},
+	{"threads", py_threads, METH_VARARGS, threads_doc},
+	{"thread_times", (PyCFunction)py_thread_times, METH_NOARGS,
+	 thread_times_doc},
+	{"usage_snapshot", (PyCFunction)py_usage_snapshot, METH_NOARGS,
+	 usage_snapshot_doc},
+	{"current_cpu", (PyCFunction)py_current_cpu, METH_NOARGS,
+	 current_cpu_doc},
+	{"current_node", (PyCFunction)py_current_node, METH_NOARGS,
+	 current_node_doc},
+	{"rseq_status", (PyCFunction)py_rseq_status, METH_NOARGS,
+	 rseq_status_doc},
+	{"benchmark_mode", (PyCFunction)py_benchmark_mode,
+	 METH_VARARGS | METH_KEYWORDS, benchmark_mode_doc},
+	{"perf_region", (PyCFunction)py_perf_region, METH_NOARGS,
+	 perf_region_doc},
+	{"apply_profile", (PyCFunction)py_apply_profile,
+	 METH_VARARGS | METH_KEYWORDS, apply_profile_doc},
+	{"profile_presets", (PyCFunction)py_profile_presets, METH_NOARGS,
+	 profile_presets_doc},
+	{"precise_sleep", (PyCFunction)py_precise_sleep,
+	 METH_VARARGS | METH_KEYWORDS, precise_sleep_doc},
+	{"wakeup_latency", (PyCFunction)py_wakeup_latency,
+	 METH_VARARGS | METH_KEYWORDS, wakeup_latency_doc},
+	{"pressure", py_pressure, METH_VARARGS, pressure_doc},
+	{"ioprio_get", py_ioprio_get, METH_VARARGS, ioprio_get_doc},
+	{"ioprio_set", (PyCFunction)py_ioprio_set,
+	 METH_VARARGS | METH_KEYWORDS, ioprio_set_doc},
+	{"process_ioprio_set", (PyCFunction)py_process_ioprio_set,
+	 METH_VARARGS | METH_KEYWORDS, process_ioprio_set_doc},
+	{"ioprio_scope", (PyCFunction)py_ioprio_scope,
+	 METH_VARARGS | METH_KEYWORDS, ioprio_scope_doc},
+	{"set_ptracer", py_set_ptracer, METH_VARARGS, set_ptracer_doc},
+	{"allow_ptrace", (PyCFunction)py_allow_ptrace,
+	 METH_VARARGS | METH_KEYWORDS, allow_ptrace_doc},
+	{"ptracer_scope", (PyCFunction)py_ptracer_scope,
+	 METH_VARARGS | METH_KEYWORDS, ptracer_scope_doc},
+	{"yama_ptrace_scope", (PyCFunction)py_yama_ptrace_scope, METH_NOARGS,
+	 yama_ptrace_scope_doc},
+	{NULL, NULL, 0, NULL}
+};
+
+PyMODINIT_FUNC initprctl(void)
+{
+	PyObject *module;
+	PyObject *dict;
+	int i = 0;
+
+	module = Py_InitModule3("prctl", _prctl_methods, module_doc);
+	if (!module)
+		return;
+
+	dict = PyModule_GetDict(module);
+	if (!dict)
+		return;
+
+	ErrorObject = PyErr_NewException("prctl.PrctlError", NULL, NULL);
+	PyDict_SetItemString(dict, "PrctlError", ErrorObject);
+
+	PyStructSequence_InitType(&ChildExitType, &child_exit_desc);
+	Py_INCREF(&ChildExitType);
+	PyModule_AddObject(module, "ChildExit", (PyObject *)&ChildExitType);
+
+	if (PyType_Ready(&ReaperType) < 0)
+		return;
+	Py_INCREF(&ReaperType);
+	PyModule_AddObject(module, "Reaper", (PyObject *)&ReaperType);
+
+	PyStructSequence_InitType(&SchedAttrType, &sched_attr_desc);
+	Py_INCREF(&SchedAttrType);
+	PyModule_AddObject(module, "SchedAttr", (PyObject *)&SchedAttrType);
+
+	if (PyType_Ready(&ScopeType) < 0)
+		return;
+
+	if (PyType_Ready(&MappedBufferType) < 0)
+		return;
+
+	if (PyType_Ready(&MeterType) < 0)
+		return;
+	Py_INCREF(&MeterType);
+	PyModule_AddObject(module, "Meter", (PyObject *)&MeterType);
+
+	if (PyType_Ready(&MeteredType) < 0)
+		return;
+
+	if (PyType_Ready(&AdaptiveSlackType) < 0)
+		return;
+	Py_INCREF(&AdaptiveSlackType);
+	PyModule_AddObject(module, "AdaptiveSlack", (PyObject *)&AdaptiveSlackType);
+
+	if (PyType_Ready(&PressureMonitorType) < 0)
+		return;
+	Py_INCREF(&PressureMonitorType);
+	PyModule_AddObject(module, "PressureMonitor",
+			   (PyObject *)&PressureMonitorType);
+
+	PyStructSequence_InitType(&PressureType, &pressure_desc);
+	Py_INCREF(&PressureType);
+	PyModule_AddObject(module, "Pressure", (PyObject *)&PressureType);
+
+	PyStructSequence_InitType(&CoreSizeType, &core_size_desc);
+	Py_INCREF(&CoreSizeType);
+	PyModule_AddObject(module, "CoreSize", (PyObject *)&CoreSizeType);
+
+	PyStructSequence_InitType(&MallocArenaType, &malloc_arena_desc);
+	Py_INCREF(&MallocArenaType);
+	PyModule_AddObject(module, "MallocArena", (PyObject *)&MallocArenaType);
+
+	PyStructSequence_InitType(&ProcStatType, &proc_stat_desc);
+	Py_INCREF(&ProcStatType);
+	PyModule_AddObject(module, "ProcStat", (PyObject *)&ProcStatType);
+
+	PyStructSequence_InitType(&ProcStatusType, &proc_status_desc);
+	Py_INCREF(&ProcStatusType);
+	PyModule_AddObject(module, "ProcStatus", (PyObject *)&ProcStatusType);
+
+	PyStructSequence_InitType(&SmapsRollupType, &smaps_rollup_desc);
+	Py_INCREF(&SmapsRollupType);
+	PyModule_AddObject(module, "SmapsRollup", (PyObject *)&SmapsRollupType);
+
+	PyStructSequence_InitType(&ThreadStatType, &thread_stat_desc);
+	Py_INCREF(&ThreadStatType);
+	PyModule_AddObject(module, "ThreadStat", (PyObject *)&ThreadStatType);
+
+	PyStructSequence_InitType(&ThreadTimesType, &thread_times_desc);
+	Py_INCREF(&ThreadTimesType);
+	PyModule_AddObject(module, "ThreadTimes", (PyObject *)&ThreadTimesType);
+
+	PyStructSequence_InitType(&MeterStatsType, &meter_stats_desc);
+	Py_INCREF(&MeterStatsType);
+	PyModule_AddObject(module, "MeterStats", (PyObject *)&MeterStatsType);
+
+	PyStructSequence_InitType(&ProfileItemType, &profile_item_desc);
+	Py_INCREF(&ProfileItemType);
+	PyModule_AddObject(module, "ProfileItem", (PyObject *)&ProfileItemType);
+
+	PyStructSequence_InitType(&WakeupLatencyType, &wakeup_latency_desc);
+	Py_INCREF(&WakeupLatencyType);
+	PyModule_AddObject(module, "WakeupLatency",
+			   (PyObject *)&WakeupLatencyType);
+
+	PyStructSequence_InitType(&MemLockType, &mem_lock_desc);
+	Py_INCREF(&MemLockType);
+	PyModule_AddObject(module, "MemLock", (PyObject *)&MemLockType);
+
+	PyStructSequence_InitType(&CpuInfoType, &cpu_info_desc);
+	Py_INCREF(&CpuInfoType);
+	PyModule_AddObject(module, "CpuInfo", (PyObject *)&CpuInfoType);
+
+	PyModule_AddIntConstant(module, "SCHED_OTHER", SCHED_OTHER);
+	PyModule_AddIntConstant(module, "SCHED_FIFO", SCHED_FIFO);
+	PyModule_AddIntConstant(module, "SCHED_RR", SCHED_RR);
+	PyModule_AddIntConstant(module, "SCHED_BATCH", SCHED_BATCH);
+	PyModule_AddIntConstant(module, "SCHED_IDLE", SCHED_IDLE);
+	PyModule_AddIntConstant(module, "SCHED_DEADLINE", SCHED_DEADLINE);
+
+	PyModule_AddIntConstant(module, "PTRACER_ANY", PTRACER_ANY);
+
+	PyModule_AddIntConstant(module, "IOPRIO_CLASS_NONE", IOPRIO_CLASS_NONE);
+	PyModule_AddIntConstant(module, "IOPRIO_CLASS_RT", IOPRIO_CLASS_RT);
+	PyModule_AddIntConstant(module, "IOPRIO_CLASS_BE", IOPRIO_CLASS_BE);
+	PyModule_AddIntConstant(module, "IOPRIO_CLASS_IDLE", IOPRIO_CLASS_IDLE);
+
+	PyModule_AddIntConstant(module, "MPOL_DEFAULT", MPOL_DEFAULT);
+	PyModule_AddIntConstant(module, "MPOL_PREFERRED", MPOL_PREFERRED);
+	PyModule_AddIntConstant(module, "MPOL_BIND", MPOL_BIND);
+	PyModule_AddIntConstant(module, "MPOL_INTERLEAVE", MPOL_INTERLEAVE);
+	PyModule_AddIntConstant(module, "MPOL_LOCAL", MPOL_LOCAL);
+	PyModule_AddIntConstant(module, "MPOL_PREFERRED_MANY",
+				MPOL_PREFERRED_MANY);
+	PyModule_AddIntConstant(module, "MPOL_WEIGHTED_INTERLEAVE",
+				MPOL_WEIGHTED_INTERLEAVE);
+	PyModule_AddIntConstant(module, "MPOL_F_NUMA_BALANCING",
+				MPOL_F_NUMA_BALANCING);
+	PyModule_AddIntConstant(module, "MPOL_F_RELATIVE_NODES",
+				MPOL_F_RELATIVE_NODES);
+	PyModule_AddIntConstant(module, "MPOL_F_STATIC_NODES",
+				MPOL_F_STATIC_NODES);
+	PyModule_AddIntConstant(module, "MPOL_MF_STRICT", MPOL_MF_STRICT);
+	PyModule_AddIntConstant(module, "MPOL_MF_MOVE", MPOL_MF_MOVE);
+	PyModule_AddIntConstant(module, "MPOL_MF_MOVE_ALL", MPOL_MF_MOVE_ALL);
+
+	PyModule_AddIntConstant(module, "MCL_CURRENT", MCL_CURRENT);
+	PyModule_AddIntConstant(module, "MCL_FUTURE", MCL_FUTURE);
+	PyModule_AddIntConstant(module, "MCL_ONFAULT", MCL_ONFAULT);
+
+	PyModule_AddIntConstant(module, "MADV_NORMAL", MADV_NORMAL);
+	PyModule_AddIntConstant(module, "MADV_RANDOM", MADV_RANDOM);
+	PyModule_AddIntConstant(module, "MADV_SEQUENTIAL", MADV_SEQUENTIAL);
+	PyModule_AddIntConstant(module, "MADV_WILLNEED", MADV_WILLNEED);
+	PyModule_AddIntConstant(module, "MADV_DONTNEED", MADV_DONTNEED);
+	PyModule_AddIntConstant(module, "MADV_HUGEPAGE", MADV_HUGEPAGE);
+	PyModule_AddIntConstant(module, "MADV_COLD", MADV_COLD);
+	PyModule_AddIntConstant(module, "MADV_PAGEOUT", MADV_PAGEOUT);
+
+	PyModule_AddIntConstant(module, "MADV_DONTDUMP", MADV_DONTDUMP);
+	PyModule_AddIntConstant(module, "MADV_DODUMP", MADV_DODUMP);
+
+	PyModule_AddIntConstant(module, "COREDUMP_ANON_PRIVATE",
+				COREDUMP_ANON_PRIVATE);
+	PyModule_AddIntConstant(module, "COREDUMP_ANON_SHARED",
+				COREDUMP_ANON_SHARED);
+	PyModule_AddIntConstant(module, "COREDUMP_FILE_PRIVATE",
+				COREDUMP_FILE_PRIVATE);
+	PyModule_AddIntConstant(module, "COREDUMP_FILE_SHARED",
+				COREDUMP_FILE_SHARED);
+	PyModule_AddIntConstant(module, "COREDUMP_ELF_HEADERS",
+				COREDUMP_ELF_HEADERS);
+	PyModule_AddIntConstant(module, "COREDUMP_HUGETLB_PRIVATE",
+				COREDUMP_HUGETLB_PRIVATE);
+	PyModule_AddIntConstant(module, "COREDUMP_HUGETLB_SHARED",
+				COREDUMP_HUGETLB_SHARED);
+	PyModule_AddIntConstant(module, "COREDUMP_DAX_PRIVATE",
+				COREDUMP_DAX_PRIVATE);
+	PyModule_AddIntConstant(module, "COREDUMP_DAX_SHARED",
+				COREDUMP_DAX_SHARED);
+
+	PyModule_AddIntConstant(module, "M_TRIM_THRESHOLD", M_TRIM_THRESHOLD);
+	PyModule_AddIntConstant(module, "M_TOP_PAD", M_TOP_PAD);
+	PyModule_AddIntConstant(module, "M_MMAP_THRESHOLD", M_MMAP_THRESHOLD);
+	PyModule_AddIntConstant(module, "M_MMAP_MAX", M_MMAP_MAX);
+	PyModule_AddIntConstant(module, "M_ARENA_TEST", M_ARENA_TEST);
+	PyModule_AddIntConstant(module, "M_ARENA_MAX", M_ARENA_MAX);
+
+	PyModule_AddIntConstant(module, "CLD_EXITED", CLD_EXITED);
+	PyModule_AddIntConstant(module, "CLD_KILLED", CLD_KILLED);
+	PyModule_AddIntConstant(module, "CLD_DUMPED", CLD_DUMPED);
 
 	while (_option_table[i].name) {
 		PyModule_AddIntConstant(module, _option_table[i].name, i);